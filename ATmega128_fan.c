@@ -3,17 +3,26 @@
  * @brief ATmega128 Full Fan & Servo Controller (Final Version)
  * @details
  * - ATmega128 @ 16MHz
- * - 24V BLDC Fan (8kHz PWM, Inverted Duty Cycle Control)
+ * - 24V BLDC Fan (8kHz PWM, Inverted Duty Cycle Control, FG tach RPM PI loop)
  * - Servo Motor (50Hz PWM, SPI Control)
- * - Bidirectional SPI communication with Raspberry Pi
+ * - Bidirectional SPI communication with Raspberry Pi (12-byte frames, CRC-8)
+ * - Cooperative scheduler (Timer0 1ms tick, per-task period and WCET)
+ * - Register access only through the HAL section (HOST_SIM: fan_sim.c runs the same logic on a PC)
+ * - Runtime parameters (slew, servo limits, duty range, ramp) set over SPI and kept in EEPROM
  */
 
 #ifndef F_CPU
 #define F_CPU 16000000UL
+#endif
 
+#ifndef HOST_SIM
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <util/delay.h>
+#include <util/atomic.h>
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#endif
 
 /* -------------------------------------------------------------------------- */
 /* 핀 및 설정값 정의 */
@@ -24,18 +33,91 @@
 #define STATUS_READY      111  // 준비 완료 (팬 꺼짐 + 90도 + 사용자 준비)
 #define STATUS_HOMING_OFF 0    // 정지/복귀 중
 
+// SPI 프레임 프로토콜 (RPi와 동일하게 유지)
+// 명령 프레임 (RPi -> ATmega):
+//   [0]헤더 0xA5 [1]명령 [2..3]값(LE) [4]속도 단계 [5]슬루 상한 [6..7]RPi 타임스탬프(LE) [8..9]예약(0)
+//   [10]시퀀스 [11]CRC-8
+//   속도: 0~2 = 단계, SPEED_POWER_FLAG | 0~100 = 연속 세기(%), SPEED_KEEP = 유지
+// 상태 프레임 (ATmega -> RPi, 같은 버스트에서 동시에 전송):
+//   [0]헤더 0x5A [1]상태 코드 [2]응답 시퀀스 [3]처리 결과 [4..5]현재 각도x10(LE)
+//   [6]속도 단계 (| SPEED_FLAG_STALL | SPEED_FLAG_PARAM) [7..8]팬 회전수 RPM(LE)
+//   [9..10]에코(LE): 마지막으로 적용한 각도 명령의 타임스탬프(지연 측정용),
+//          SPEED_FLAG_PARAM이면 마지막 OP_GET_PARAM 값 [11]CRC-8
+#define SPI_FRAME_LEN      12
+#define SPI_CMD_HEADER     0xA5
+#define SPI_STATUS_HEADER  0x5A
+#define SPI_RX_RING_SIZE   32   // 2의 거듭제곱
+
+// 명령 코드
+#define OP_POLL            0x00  // 상태 조회만
+#define OP_START           0x01  // 팬 시작
+#define OP_RESET           0x02  // 리셋 (자동 정지)
+#define OP_TRACK           0x03  // 각도(0.1도 단위) + 속도 + 슬루 설정
+#define OP_SET_OCR         0x04  // 서보 OCR 직접 설정
+#define OP_SET_FAN_RAMP    0x05  // 팬 램프 시간 설정 (값 = 최약~최강 전체 구간 ms)
+#define OP_SET_PARAM       0x06  // 설정값 변경 ([4] = 설정 번호, 값), RAM에만 적용
+#define OP_GET_PARAM       0x07  // 설정값 조회 ([4] = 설정 번호, 다음 상태 프레임 에코에 값)
+#define OP_SAVE_PARAMS     0x08  // 설정값 EEPROM 저장 (값 1 = 기본값으로 되돌린 뒤 저장)
+
+// 설정 번호 (OP_SET_PARAM/OP_GET_PARAM, EEPROM에도 이 순서로 저장)
+#define PARAM_SLEW_MAX_STEP  0   // 기본 최대 속도 (기존 해상도 OCR 카운트/프레임, 1~255)
+#define PARAM_SLEW_ACCEL     1   // 가감속 (기존 해상도 OCR 카운트/프레임, 1~255)
+#define PARAM_ANGLE10_MIN    2   // 각도 명령 하한 (0.1도, SERVO_ANGLE10_MIN~90도)
+#define PARAM_ANGLE10_MAX    3   // 각도 명령 상한 (0.1도, 90도~SERVO_ANGLE10_MAX)
+#define PARAM_DUTY_WEAKEST   4   // 세기 0%의 OCR3A (기본 DUTY_HIGH)
+#define PARAM_DUTY_STRONGEST 5   // 세기 100%의 OCR3A (기본 DUTY_LOW)
+#define PARAM_FAN_RAMP_MS    6   // 팬 램프 시간 (ms, OP_SET_FAN_RAMP와 같음)
+#define PARAM_COUNT          7
+
+#define SPEED_KEEP         0xFF  // 속도 단계 변경 안 함
+#define SPEED_POWER_FLAG   0x80  // 하위 7비트 = 팬 세기 0~100%
+#define SPEED_FLAG_STALL   0x80  // 상태 프레임: 팬 정지(회전 없음) 감지
+#define SPEED_FLAG_PARAM   0x40  // 상태 프레임: 에코가 타임스탬프가 아니라 OP_GET_PARAM 값
+#define SLEW_KEEP          0     // 슬루 = 설정값 PARAM_SLEW_MAX_STEP
+
+// 처리 결과
+#define ACK_OK             0
+#define ACK_CRC_ERROR      1
+#define ACK_REJECTED       2     // 현재 상태에서 수행 불가
+#define ACK_BAD_OPCODE     3
+
 // 선풍기 제어 핀
 #define SWITCH_DDR         DDRD
 #define SWITCH_PIN         PIND
 #define SWITCH_SPEED_PIN   PD0  // 속도 조절 버튼
 #define SWITCH_TOGGLE_PIN  PD1  // 시스템 활성화 버튼
 
+// 버튼 설정 (PD0 = INT0, PD1 = INT1, 외부 풀다운 -> 누르면 HIGH)
+// 버튼 번호 = PIND 비트 = INTn 번호
+#define BUTTON_SPEED         0
+#define BUTTON_TOGGLE        1
+#define BUTTON_COUNT         2
+#define BUTTON_DEBOUNCE_MS   30    // 같은 레벨이 이 시간 유지되면 확정
+#define BUTTON_LONG_MS       800   // 길게 누름 판정 시간
+#define BUTTON_QUEUE_SIZE    8     // 2의 거듭제곱
+
+// 버튼 디바운스 상태
+#define BUTTON_IDLE          0     // 외부 인터럽트 대기
+#define BUTTON_PRESSING      1     // 눌림 확인 중
+#define BUTTON_HELD          2     // 눌림 확정
+#define BUTTON_RELEASING     3     // 뗌 확인 중
+
+// 버튼 이벤트 (하위 비트 = 버튼 번호)
+#define BUTTON_EVT_PRESS     0x00  // 눌림 확정 시 1회
+#define BUTTON_EVT_LONG      0x80  // BUTTON_LONG_MS 이상 누르고 있으면 추가로 1회
+
 #define LED_DDR            DDRC
 #define LED_PORT           PORTC
 #define LED_LOW_PIN        PC0  // 미풍 LED
 #define LED_MEDIUM_PIN     PC1  // 약풍 LED
 #define LED_HIGH_PIN       PC2  // 강풍 LED
 
+// 상태 변경 알림 핀 (ATmega -> RPi GPIO, 5V -> 3.3V 분압 필요)
+// 새 상태 코드가 담긴 프레임을 준비하면 HIGH, RPi가 다음 명령 프레임을 보내면 LOW
+#define STATUS_IRQ_DDR     DDRC
+#define STATUS_IRQ_PORT    PORTC
+#define STATUS_IRQ_PIN     PC3
+
 #define FAN_PWM_DDR         DDRE
 #define FAN_PWM_PORT        PORTE
 #define FAN_PWM_PIN         PE3  // Timer3 OC3A
@@ -46,36 +128,285 @@
 #define DUTY_MEDIUM       (uint16_t)(ICR_8KHZ * 0.4)  // 40% -> 약풍
 #define DUTY_HIGH         (uint16_t)(ICR_8KHZ * 0.6)  // 60% -> 미풍
 
+// 팬 세기 램프 (세기 0% = PARAM_DUTY_WEAKEST, 100% = PARAM_DUTY_STRONGEST, 사이는 선형)
+// 시작은 미풍 듀티에서, 정지는 미풍 듀티까지 내린 뒤 출력 차단
+#define FAN_POWER_MAX       100
+#define FAN_OCR_RANGE       (params[PARAM_DUTY_WEAKEST] - params[PARAM_DUTY_STRONGEST])
+#define FAN_RAMP_TIME_MS    1500   // 기본 램프 시간 (최약 -> 최강, ms)
+#define FAN_RAMP_TIME_MAX   10000
+
+// 팬 회전수 (FG 신호 -> PE7 = INT7, 오픈 컬렉터이므로 풀업 필요)
+// 타이머 입력 캡처(ICP1/ICP3)는 ICR1/ICR3이 PWM TOP이라 쓸 수 없어서 외부 인터럽트 + 스케줄러 시각(4us) 사용
+#define FAN_RPM_CONTROL        1     // 1: 회전수 PI 제어, 0: 측정/정지 감지만
+#define FAN_TACH_PULSES_PER_REV 2    // 회전당 FG 펄스 수
+#define FAN_TACH_MIN_PERIOD    250   // 이보다 짧은 펄스 간격은 잡음으로 무시 (4us 단위 = 1ms)
+#define FAN_RPM_AT_MIN         900   // 세기 0%의 목표 회전수 (설치한 팬에 맞게 보정)
+#define FAN_RPM_AT_MAX         2700  // 세기 100%의 목표 회전수
+#define FAN_SPINUP_MS          1500  // 시작 후 이 시간 동안은 PI/정지 감지 안 함
+#define FAN_STALL_MS           1000  // 회전 없이 이 시간이 지나면 정지로 판단 (FG 펄스를 한 번이라도 본 뒤에만)
+#define FAN_PI_KP_DIV          4     // 비례 이득 = 1/4 OCR 카운트/RPM
+#define FAN_PI_KI_DIV          32    // 적분 이득 = 1/32 OCR 카운트/(RPM x 주기)
+#define FAN_TRIM_MAX           200   // PI 보정 한계 (OCR 카운트)
+#define FAN_OCR_STRONGEST      (uint16_t)(ICR_8KHZ * 0.1)  // PI 보정 후 허용 범위
+#define FAN_OCR_WEAKEST        (uint16_t)(ICR_8KHZ * 0.7)
+
 // 서보모터 제어 핀
 #define SERVO_DDR          DDRB
 #define SERVO_PIN          DDB5  // Timer1 OC1A
 
 // 서보모터 PWM 설정 (50Hz)
-#define SERVO_CW_MAX     610  // 170도
-#define SERVO_CCW_MAX    140  // 10도
-#define SERVO_CENTER     375  // 90도
+// 1: 고해상도 (/8 분주, ICR1 = 39999, 0.5us 단위), 0: 기존 (/64 분주, ICR1 = 4999, 4us 단위)
+#define SERVO_HIGH_RES   1
+
+#if SERVO_HIGH_RES
+#define SERVO_ICR        39999
+#define SERVO_PRESCALER  (1 << CS11)
+#define SERVO_OCR_SCALE  8
+#define SERVO_LUT_SHIFT  0
+#else
+#define SERVO_ICR        4999
+#define SERVO_PRESCALER  ((1 << CS11) | (1 << CS10))
+#define SERVO_OCR_SCALE  1
+#define SERVO_LUT_SHIFT  3
+#endif
+
+#define SERVO_CW_MAX     (610 * SERVO_OCR_SCALE)  // 170도
+#define SERVO_CCW_MAX    (140 * SERVO_OCR_SCALE)  // 10도
+#define SERVO_CENTER     (375 * SERVO_OCR_SCALE)  // 90도
+#define SERVO_ANGLE10_MIN  100   // 10.0도
+#define SERVO_ANGLE10_MAX  1700  // 170.0도
+#define SERVO_ANGLE10_CENTER 900 // 90.0도 (복귀 위치라 각도 제한에 항상 포함)
+
+// 서보 슬루 설정 (서보 작업 = 50Hz 프레임마다 갱신)
+// SPI 슬루 값은 기존 해상도 단위로 받아서 SERVO_OCR_SCALE 배로 적용
+#define SERVO_SLEW_MAX_STEP  (24 * SERVO_OCR_SCALE)  // 프레임당 최대 이동량 (OCR 카운트)
+#define SERVO_SLEW_ACCEL     (4 * SERVO_OCR_SCALE)   // 프레임당 속도 변화량 (가감속)
+
+// 스케줄러 설정 (Timer0 CTC, /64 분주, 16MHz / 64 / 250 = 1kHz 틱)
+#define SCHED_TICK_OCR0      249   // 틱당 Timer0 카운트 - 1 (1카운트 = 4us)
+#define TASK_PERIOD_SERVO    20    // 서보 슬루 (ms, 서보 PWM 프레임과 같게)
+#define TASK_PERIOD_BUTTONS  1     // 버튼 디바운스 + 이벤트 처리 (ms)
+#define TASK_PERIOD_STATUS   2     // 상태 결정 + SPI 응답 갱신 (ms)
+#define TASK_PERIOD_FAN      10    // 팬 듀티 램프 (ms)
+#define TASK_PERIOD_RPM      100   // 회전수 계산 + PI + 정지 감지 (ms)
+#define TASK_PERIOD_EEPROM   5     // 설정값 EEPROM 쓰기 (ms, 1바이트 쓰기 약 3.4ms)
+#define SCHED_TIMESTAMP_HZ   250000UL  // sched_timestamp() 단위 (4us)
+
+// 설정값 EEPROM 블록: [0]PARAMS_MAGIC [1..]설정값(LE, PARAM_COUNT x 2) [끝]CRC-8
+// 쓰기는 task_eeprom이 바이트 단위로 나눠서 처리 (쓰는 중 전원이 꺼지면 CRC 불일치 -> 기본값)
+#define PARAMS_EEPROM_ADDR   0
+#define PARAMS_MAGIC         0xF1  // 블록 형식이 바뀌면 올림
+#define PARAMS_IMAGE_LEN     (2 + PARAM_COUNT * 2)
 
 // SPI 통신 핀
 #define SPI_DDR            DDRB
+#define SPI_INPUT          PINB
 #define SPI_PIN_SS         DDB0
 #define SPI_PIN_SCK        DDB1
 #define SPI_PIN_MOSI       DDB2
 #define SPI_PIN_MISO       DDB3
 
+/* -------------------------------------------------------------------------- */
+/* 하드웨어 접근 (HAL) */
+/* -------------------------------------------------------------------------- */
+// 제어 로직은 레지스터 대신 이 함수들만 사용 (HOST_SIM이면 fan_sim.c가 같은 이름으로 시뮬레이션)
+// 초기화, ISR 진입점, main()은 아래 AVR 전용 절에 있음
+
+#ifndef HOST_SIM
+static inline void hal_servo_write(uint16_t ocr) {
+    OCR1A = ocr;  // BOTTOM에서 갱신되므로 프레임 중간에 바꿔도 펄스가 깨지지 않음
+}
+
+static inline void hal_fan_write(uint16_t ocr) {
+    OCR3A = ocr;  // TOP에서 갱신되므로 PWM 주기 중간이어도 안전
+}
+
+static inline void hal_fan_output(uint8_t on) {
+    if (on) {
+        TCCR3A |= (1 << COM3A1);
+        TCCR3B |= (1 << CS30);
+    } else {
+        // 타이머 정지 + 핀 LOW
+        TCCR3B &= ~(1 << CS30);
+        TCCR3A &= ~(1 << COM3A1);
+        FAN_PWM_PORT &= ~(1 << FAN_PWM_PIN);
+    }
+}
+
+static inline uint8_t hal_fan_output_enabled(void) {
+    return (TCCR3B & (1 << CS30)) ? 1 : 0;
+}
+
+static inline void hal_leds_write(uint8_t leds) {
+    // 비트 0 = 미풍, 1 = 약풍, 2 = 강풍
+    uint8_t port = LED_PORT & ~((1 << LED_LOW_PIN) | (1 << LED_MEDIUM_PIN) | (1 << LED_HIGH_PIN));
+    if (leds & 0x01) port |= (1 << LED_LOW_PIN);
+    if (leds & 0x02) port |= (1 << LED_MEDIUM_PIN);
+    if (leds & 0x04) port |= (1 << LED_HIGH_PIN);
+    LED_PORT = port;
+}
+
+static inline void hal_status_irq(uint8_t level) {
+    if (level) {
+        STATUS_IRQ_PORT |= (1 << STATUS_IRQ_PIN);
+    } else {
+        STATUS_IRQ_PORT &= ~(1 << STATUS_IRQ_PIN);
+    }
+}
+
+static inline uint8_t hal_button_level(uint8_t button) {
+    return (SWITCH_PIN >> button) & 1;
+}
+
+static inline void hal_button_irq(uint8_t button, uint8_t enable) {
+    // 메인 루프(button_rearm)에서도 부르므로 EIMSK 읽기-수정-쓰기 중에 다른 INTn이 끼어들면
+    // 그 ISR이 끈 비트를 되살리게 됨 -> 원자적으로
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (enable) {
+            // 꺼져 있는 동안 쌓인 플래그를 지우고 다시 허용
+            EIFR = (1 << (INTF0 + button));
+            EIMSK |= (1 << (INT0 + button));
+        } else {
+            EIMSK &= ~(1 << (INT0 + button));
+        }
+    }
+}
+
+static inline uint8_t hal_tick_count(void) {
+    return TCNT0;
+}
+
+static inline uint8_t hal_tick_pending(void) {
+    // 카운터는 넘어갔지만 틱 ISR이 아직 실행되지 않음
+    return (TIFR & (1 << OCF0)) ? 1 : 0;
+}
+
+static inline void hal_spi_write(uint8_t data) {
+    SPDR = data;
+}
+
+static inline uint8_t hal_spi_selected(void) {
+    return (SPI_INPUT & (1 << SPI_PIN_SS)) ? 0 : 1;  // SS LOW = RPi가 프레임 전송 중
+}
+
+static inline uint8_t hal_spi_pending(void) {
+    // 바이트는 받았지만 SPI ISR이 아직 실행되지 않음
+    return (SPSR & (1 << SPIF)) ? 1 : 0;
+}
+
+static inline uint8_t hal_eeprom_ready(void) {
+    return eeprom_is_ready() ? 1 : 0;
+}
+
+static inline uint8_t hal_eeprom_read(uint16_t addr) {
+    return eeprom_read_byte((const uint8_t *)addr);
+}
+
+static inline void hal_eeprom_write(uint16_t addr, uint8_t data) {
+    // 쓰기 시작만 하고 반환 (완료는 hal_eeprom_ready로 확인)
+    eeprom_write_byte((uint8_t *)addr, data);
+}
+#endif
+
 /* -------------------------------------------------------------------------- */
 /* 전역 변수 */
 /* -------------------------------------------------------------------------- */
 
 volatile uint8_t motor_running = 0;        // 팬 동작 상태
-volatile uint8_t speed_level = 0;          // 속도 단계 (0, 1, 2)
+volatile uint8_t speed_level = 0;          // 속도 단계 (0, 1, 2, 연속 세기면 가장 가까운 단계)
+uint8_t fan_power = 0;                     // 목표 팬 세기 (0~100%)
+uint16_t fan_duty_ocr = DUTY_HIGH;         // 현재 OCR3A (램프 중간값)
+uint16_t fan_base_ocr = DUTY_HIGH;         // 세기에 해당하는 OCR3A (PI 보정 전)
+uint16_t fan_target_ocr = DUTY_HIGH;       // 램프 목표 OCR3A
+uint16_t fan_ramp_step;                    // 램프 작업 1회당 OCR 변화량
+uint8_t fan_stopping = 0;                  // 미풍까지 내린 뒤 출력 차단 대기
+
+// 팬 회전수 측정 (INT7 ISR -> 회전수 작업)
+volatile uint16_t tach_last = 0;           // 마지막 펄스 시각 (4us)
+volatile uint8_t tach_valid = 0;           // tach_last가 유효한지
+volatile uint16_t tach_start = 0;          // 이번 창 첫 펄스 직전 펄스 시각 (주기 합 = tach_last - tach_start)
+volatile uint8_t tach_pulse_count = 0;
+uint16_t fan_rpm = 0;                      // 측정 회전수
+uint8_t fan_stalled = 0;                   // 구동 중인데 회전 없음
+uint8_t fan_tach_seen = 0;                 // FG 펄스를 받은 적 있음 (FG 선이 없는 팬은 측정/PI/정지 감지 안 함)
+uint16_t fan_run_ms = 0;                   // 시작 후 경과 시간 (FAN_SPINUP_MS까지)
+uint16_t fan_idle_ms = 0;                  // 펄스 없이 지난 시간
+int16_t fan_trim = 0;                      // PI 보정 (OCR 카운트, +: 세게)
+int32_t fan_rpm_integral = 0;
 volatile uint8_t user_ready_flag = 0;      // 사용자 준비 상태
 volatile uint8_t servo_homing_required = 0; // 서보 복귀 필요 플래그
 
 volatile uint16_t servo_current_ocr;       // 서보 현재 위치
 volatile uint16_t servo_target_ocr;        // 서보 목표 위치
+volatile int16_t servo_velocity = 0;       // 서보 현재 속도 (카운트/프레임, 부호 = 방향)
+
+volatile uint16_t servo_slew_max_step = SERVO_SLEW_MAX_STEP; // 최대 속도
+volatile uint16_t servo_slew_accel = SERVO_SLEW_ACCEL;       // 가속도
+
+// 런타임 설정값 (PARAM_*, init_state에서 EEPROM 또는 기본값으로 채움)
+uint16_t params[PARAM_COUNT];
+uint8_t params_image[PARAMS_IMAGE_LEN];    // EEPROM에 쓸 블록
+uint8_t params_write_pos = PARAMS_IMAGE_LEN; // 다음에 쓸 바이트 (PARAMS_IMAGE_LEN = 쓸 것 없음)
+
+// 각도(1도 단위, 10~170도) -> OCR 변환표 (고해상도 단위, 서보 보정이 필요하면 이 값만 수정)
+const uint16_t servo_angle_table[161] PROGMEM = {
+    1120, 1144, 1167, 1190, 1214, 1238, 1261, 1284, 1308, 1332,  // 10~19도
+    1355, 1378, 1402, 1426, 1449, 1472, 1496, 1520, 1543, 1566,  // 20~29도
+    1590, 1614, 1637, 1660, 1684, 1708, 1731, 1754, 1778, 1802,  // 30~39도
+    1825, 1848, 1872, 1896, 1919, 1942, 1966, 1990, 2013, 2036,  // 40~49도
+    2060, 2084, 2107, 2130, 2154, 2178, 2201, 2224, 2248, 2272,  // 50~59도
+    2295, 2318, 2342, 2366, 2389, 2412, 2436, 2460, 2483, 2506,  // 60~69도
+    2530, 2554, 2577, 2600, 2624, 2648, 2671, 2694, 2718, 2742,  // 70~79도
+    2765, 2788, 2812, 2836, 2859, 2882, 2906, 2930, 2953, 2976,  // 80~89도
+    3000, 3024, 3047, 3070, 3094, 3118, 3141, 3164, 3188, 3212,  // 90~99도
+    3235, 3258, 3282, 3306, 3329, 3352, 3376, 3400, 3423, 3446,  // 100~109도
+    3470, 3494, 3517, 3540, 3564, 3588, 3611, 3634, 3658, 3682,  // 110~119도
+    3705, 3728, 3752, 3776, 3799, 3822, 3846, 3870, 3893, 3916,  // 120~129도
+    3940, 3964, 3987, 4010, 4034, 4058, 4081, 4104, 4128, 4152,  // 130~139도
+    4175, 4198, 4222, 4246, 4269, 4292, 4316, 4340, 4363, 4386,  // 140~149도
+    4410, 4434, 4457, 4480, 4504, 4528, 4551, 4574, 4598, 4622,  // 150~159도
+    4645, 4668, 4692, 4716, 4739, 4762, 4786, 4810, 4833, 4856,  // 160~169도
+    4880  // 170도
+};
 
 volatile uint8_t current_spi_status = 0;   // 현재 상태 코드
 
+// SPI 수신 링버퍼 (ISR -> 메인 루프)
+volatile uint8_t spi_rx_ring[SPI_RX_RING_SIZE];
+volatile uint8_t spi_rx_head = 0;
+volatile uint8_t spi_rx_tail = 0;
+volatile uint8_t spi_frame_pos = 0;        // 현재 프레임 내 바이트 위치
+
+// SPI 송신 상태 프레임 (이중 버퍼, 프레임 시작 시 교체)
+volatile uint8_t spi_tx_buf[2][SPI_FRAME_LEN];
+volatile uint8_t spi_tx_active = 0;
+volatile uint8_t spi_tx_pending = 0;
+volatile uint8_t *spi_tx_frame = spi_tx_buf[0]; // ISR용 활성 버퍼 포인터
+
+// 버튼 디바운스 (INTn ISR이 시작, scheduler_run의 task_buttons가 진행) 및 이벤트 큐 (디바운스 -> 이벤트 처리, 둘 다 task_buttons)
+volatile uint8_t button_state[BUTTON_COUNT];
+uint8_t button_debounce[BUTTON_COUNT];     // 레벨 유지 시간 (ms)
+uint16_t button_hold[BUTTON_COUNT];        // 눌림 확정 후 경과 시간 (ms)
+volatile uint8_t button_queue[BUTTON_QUEUE_SIZE];
+volatile uint8_t button_queue_head = 0;
+volatile uint8_t button_queue_tail = 0;
+
+// 스케줄러 (틱 = 1ms, ISR에서 증가)
+volatile uint16_t sched_ticks = 0;
+uint16_t sched_overruns = 0;               // 한 주기 이상 밀린 작업 실행 횟수
+
+typedef struct {
+    void (*run)(void);
+    uint16_t period;                       // 실행 주기 (틱)
+    uint16_t next;                         // 다음 실행 틱
+    uint16_t wcet;                         // 최악 실행 시간 (4us 단위, JTAG로 확인)
+} sched_task_t;
+
+uint8_t spi_ack_seq = 0;                   // 마지막으로 처리한 명령 시퀀스
+uint8_t spi_ack_result = ACK_OK;           // 마지막 명령 처리 결과
+uint16_t spi_echo = 0;                     // 마지막 각도 명령의 RPi 타임스탬프 또는 조회한 설정값
+uint8_t spi_echo_param = 0;                // spi_echo가 조회한 설정값 (SPEED_FLAG_PARAM)
+
 /* -------------------------------------------------------------------------- */
 /* 함수 선언 */
 /* -------------------------------------------------------------------------- */
@@ -84,49 +415,151 @@ void init_ports(void);
 void init_spi_slave(void);
 void init_timer1_servo(void);
 void init_timer3_fan_pwm(void);
+void init_buttons(void);
+void init_scheduler(void);
+void init_state(void);
+uint16_t sched_now(void);
+uint16_t sched_timestamp(void);
+void scheduler_run(void);
+void task_servo(void);
+void task_buttons(void);
+void task_status(void);
+void task_fan_ramp(void);
+void task_fan_rpm(void);
+void task_eeprom(void);
+void button_begin(uint8_t button);
+void button_tick(uint8_t button);
+void button_rearm(uint8_t button);
+void button_push_event(uint8_t event);
+uint8_t button_pop_event(uint8_t *event);
+void servo_slew_update(uint16_t target);
+uint16_t servo_get_position(void);
 void set_fan_speed(uint8_t level);
+void set_fan_power(uint8_t power);
+void set_fan_ramp_time(uint16_t ramp_ms);
+void fan_apply_target(void);
 void update_leds(void);
 void start_fan(void);
 void stop_fan(void);
+uint8_t crc8(const uint8_t *data, uint8_t length);
+uint16_t angle10_to_ocr(uint16_t angle10);
+uint16_t ocr_to_angle10(uint16_t ocr);
+void servo_set_target(uint16_t ocr);
+void spi_poll_frames(void);
+void spi_handle_frame(const uint8_t *frame);
+void spi_publish_status(uint8_t force);
+void params_defaults(void);
+void params_load(void);
+void params_save(void);
+uint8_t param_set(uint8_t id, uint16_t value);
+void params_apply(uint8_t id);
 
 /* -------------------------------------------------------------------------- */
-/* SPI 인터럽트 서비스 루틴 */
+/* 스케줄러 작업 표 (새 주기 작업은 여기에 추가) */
 /* -------------------------------------------------------------------------- */
 
-ISR(SPI_STC_vect) {
-    uint8_t received_data = SPDR;
+sched_task_t sched_tasks[] = {
+    { task_servo,    TASK_PERIOD_SERVO,   0, 0 },
+    { task_buttons,  TASK_PERIOD_BUTTONS, 0, 0 },
+    { task_status,   TASK_PERIOD_STATUS,  0, 0 },
+    { task_fan_ramp, TASK_PERIOD_FAN,     0, 0 },
+    { task_fan_rpm,  TASK_PERIOD_RPM,     0, 0 },
+    { task_eeprom,   TASK_PERIOD_EEPROM,  0, 0 },
+};
+#define SCHED_TASK_COUNT  (sizeof(sched_tasks) / sizeof(sched_tasks[0]))
 
-    if (received_data == 200) {
-        // [명령 200]: 리셋 (자동 정지)
-        if (motor_running) {
-            stop_fan();
-        }
-        user_ready_flag = 0;
-        servo_homing_required = 1;  // 90도 복귀 시작
-        
-    } else if (received_data >= 10 && received_data <= 170) {
-        // [명령 10-170]: 각도 설정
-        // 작동 중이고 준비 상태일 때만 각도 명령 수신
-        if (user_ready_flag == 1 && motor_running == 1) {
-            long ocr_value;
-            ocr_value = (long)(received_data - 10) * (SERVO_CW_MAX - SERVO_CCW_MAX) / 160 + SERVO_CCW_MAX;
-            servo_target_ocr = ocr_value;
+/* -------------------------------------------------------------------------- */
+/* 인터럽트 본문 (ISR 진입점은 AVR 전용 절, 시뮬레이터는 직접 호출) */
+/* -------------------------------------------------------------------------- */
+
+static inline void spi_isr_byte(uint8_t received_data) {
+    // 송신 버퍼가 없으므로 다음 바이트 전까지 SPDR을 채워야 함 (RPi가 바이트 사이에 SPI_BYTE_DELAY_US를 둠)
+    // 그 여유는 다른 ISR 실행 시간까지 포함해야 하므로 계산 없이 수신 바이트만 링버퍼에 넣음
+    uint8_t pos = spi_frame_pos;
+
+    if (pos == 0) {
+        if (received_data != SPI_CMD_HEADER) {
+            // 헤더를 찾을 때까지 버림 (프레임 동기)
+            hal_spi_write(SPI_STATUS_HEADER);
+            return;
         }
-    } 
-    else if (received_data == 255) {
-        // [명령 255]: 팬 시작
-        if (current_spi_status == STATUS_READY) {
-            start_fan();
+        // 새 프레임 시작: 최신 상태 프레임으로 교체
+        if (spi_tx_pending) {
+            spi_tx_active ^= 1;
+            spi_tx_frame = spi_tx_buf[spi_tx_active];
+            spi_tx_pending = 0;
         }
     }
-    // 0: 폴링 명령 (응답만 보냄)
 
-    // 다음 응답 준비
-    SPDR = current_spi_status;
+    // 다음 응답 바이트를 가장 먼저 준비
+    if (++pos >= SPI_FRAME_LEN) pos = 0;
+    hal_spi_write(spi_tx_frame[pos]);
+    spi_frame_pos = pos;
+
+    uint8_t head = spi_rx_head;
+    uint8_t next = (head + 1) & (SPI_RX_RING_SIZE - 1);
+    if (next != spi_rx_tail) {
+        spi_rx_ring[head] = received_data;
+        spi_rx_head = next;
+    }
+}
+
+static inline uint16_t sched_timestamp_nolock(void) {
+    // sched_timestamp() 본문 (인터럽트가 꺼진 상태에서만, ISR은 함수 호출/ATOMIC_BLOCK 없이 이것을 씀)
+    uint16_t ticks = sched_ticks;
+    uint8_t count = hal_tick_count();
+    if (hal_tick_pending() && count < SCHED_TICK_OCR0) {
+        ticks++;  // 카운터는 넘어갔지만 ISR이 아직 틱을 세지 않음
+    }
+    return ticks * (SCHED_TICK_OCR0 + 1) + count;
+}
+
+static inline void tach_isr_pulse(void) {
+    // 팬 FG 펄스: 시각과 개수만 기록 (16비트 연산만, 나눗셈/누적은 task_fan_rpm)
+    // SPI_STC보다 우선순위가 높아 버스트 중 펄스면 SPI 바이트 여유를 그대로 잡아먹으므로 짧게 유지
+    uint16_t now = sched_timestamp_nolock();
+
+    if (tach_valid) {
+        if ((uint16_t)(now - tach_last) < FAN_TACH_MIN_PERIOD) return;  // 잡음
+        if (tach_pulse_count == 0) tach_start = tach_last;
+        tach_pulse_count++;
+    }
+    tach_last = now;
+    tach_valid = 1;
+}
+
+static inline void sched_tick_isr(void) {
+    // 1ms 틱: 작업은 메인 루프의 scheduler_run()에서 실행
+    sched_ticks++;
+}
+
+#ifndef HOST_SIM
+/* -------------------------------------------------------------------------- */
+/* 인터럽트 서비스 루틴 (AVR 전용) */
+/* -------------------------------------------------------------------------- */
+
+ISR(SPI_STC_vect) {
+    spi_isr_byte(SPDR);
+}
+
+ISR(INT0_vect) {
+    button_begin(BUTTON_SPEED);
+}
+
+ISR(INT1_vect) {
+    button_begin(BUTTON_TOGGLE);
+}
+
+ISR(INT7_vect) {
+    tach_isr_pulse();
+}
+
+ISR(TIMER0_COMP_vect) {
+    sched_tick_isr();
 }
 
 /* -------------------------------------------------------------------------- */
-/* 메인 함수 */
+/* 메인 함수 (AVR 전용) */
 /* -------------------------------------------------------------------------- */
 
 int main(void) {
@@ -135,112 +568,25 @@ int main(void) {
     init_timer1_servo();
     init_timer3_fan_pwm();
     init_spi_slave();
+    init_buttons();
+    init_scheduler();
 
-    // 서보 초기 위치
-    servo_current_ocr = SERVO_CENTER;
-    servo_target_ocr = SERVO_CENTER;
-    OCR1A = servo_current_ocr;
-    
-    // 시스템 초기 상태
-    stop_fan();
-    user_ready_flag = 0;
-    servo_homing_required = 0;
-
-    // 첫 SPI 응답 준비
-    SPDR = STATUS_HOMING_OFF;
+    // 제어 상태 초기화 + 첫 SPI 응답 준비
+    init_state();
+    hal_spi_write(SPI_STATUS_HEADER);
     
     // 전역 인터럽트 활성화
     sei();
 
-    // 버튼 디바운싱 변수
-    uint8_t toggle_button_pressed = 0;
-    uint8_t speed_button_pressed = 0;
-
     while (1) {
-        
-        // ===== PD1 버튼 처리 (시스템 ON/OFF) =====
-        if (SWITCH_PIN & (1 << SWITCH_TOGGLE_PIN)) {
-            if (!toggle_button_pressed) {
-                toggle_button_pressed = 1;
-                _delay_ms(50);
-                
-                if (user_ready_flag == 1) {
-                    // 켜져있으면 끄기
-                    user_ready_flag = 0;
-                    if (motor_running) {
-                        stop_fan();
-                    }
-                    servo_homing_required = 1;
-                } else {
-                    // 꺼져있으면 켜기 (90도 복귀 시작)
-                    user_ready_flag = 1;
-                    servo_target_ocr = SERVO_CENTER;
-                    servo_homing_required = 1;
-                }
-            }
-        } else {
-            toggle_button_pressed = 0;
-        }
-
-        // ===== 팬 작동 상태별 처리 =====
-        if (motor_running) {
-            // ----- 팬 작동 중 -----
-            
-            // PD0 버튼: 속도 조절
-            if (SWITCH_PIN & (1 << SWITCH_SPEED_PIN)) {
-                if (!speed_button_pressed) {
-                    speed_button_pressed = 1;
-                    _delay_ms(50);
-                    speed_level++;
-                    if (speed_level > 2) speed_level = 0;
-                    set_fan_speed(speed_level);
-                }
-            } else {
-                speed_button_pressed = 0;
-            }
-            
-            // 서보 추적 (SPI 명령 따라가기) - 1씩 천천히
-            if (servo_current_ocr < servo_target_ocr) {
-                servo_current_ocr++;
-                OCR1A = servo_current_ocr;
-            } else if (servo_current_ocr > servo_target_ocr) {
-                servo_current_ocr--;
-                OCR1A = servo_current_ocr;
-            }
-            
-            current_spi_status = STATUS_RUNNING;
-
-        } else {
-            // ----- 팬 정지 중 -----
-            
-            // 90도 복귀 처리 - 1씩 천천히
-            if (servo_homing_required || user_ready_flag == 1) {
-                if (servo_current_ocr < SERVO_CENTER) {
-                    servo_current_ocr++;
-                    OCR1A = servo_current_ocr;
-                } else if (servo_current_ocr > SERVO_CENTER) {
-                    servo_current_ocr--;
-                    OCR1A = servo_current_ocr;
-                } else {
-                    // 90도 도착 완료
-                    servo_homing_required = 0;
-                }
-            }
-            
-            // 상태 결정
-            if (user_ready_flag == 1 && servo_current_ocr == SERVO_CENTER) {
-                current_spi_status = STATUS_READY;  // 준비 완료
-            } else {
-                current_spi_status = STATUS_HOMING_OFF;  // 정지/복귀 중
-            }
-        }
-        
-        _delay_ms(2);  // 2ms 딜레이 (서보 속도 조절)
+        // SPI 프레임은 도착하는 대로 처리, 나머지는 주기 작업
+        spi_poll_frames();
+        scheduler_run();
     }
 }
 
 /* -------------------------------------------------------------------------- */
-/* 함수 정의 */
+/* 하드웨어 초기화 (AVR 전용) */
 /* -------------------------------------------------------------------------- */
 
 void init_ports(void) {
@@ -248,11 +594,34 @@ void init_ports(void) {
     FAN_PWM_DDR |= (1 << FAN_PWM_PIN);
     LED_DDR |= (1 << LED_LOW_PIN) | (1 << LED_MEDIUM_PIN) | (1 << LED_HIGH_PIN);
     SERVO_DDR |= (1 << SERVO_PIN);
+    STATUS_IRQ_DDR |= (1 << STATUS_IRQ_PIN);
+    STATUS_IRQ_PORT &= ~(1 << STATUS_IRQ_PIN);
     
     // 입력 핀 (외부 풀다운)
     SWITCH_DDR &= ~((1 << SWITCH_SPEED_PIN) | (1 << SWITCH_TOGGLE_PIN));
 }
 
+void init_buttons(void) {
+    // INT0/INT1 상승 에지 (눌림)
+    EICRA |= (1 << ISC01) | (1 << ISC00) | (1 << ISC11) | (1 << ISC10);
+    EIFR = (1 << INTF0) | (1 << INTF1);
+    EIMSK |= (1 << INT0) | (1 << INT1);
+
+    // 팬 FG 신호: PE7 입력 (내부 풀업), INT7 상승 에지
+    DDRE &= ~(1 << PE7);
+    PORTE |= (1 << PE7);
+    EICRB |= (1 << ISC71) | (1 << ISC70);
+    EIFR = (1 << INTF7);
+    EIMSK |= (1 << INT7);
+}
+
+void init_scheduler(void) {
+    // Timer0 CTC, /64 분주, 1kHz 틱
+    TCCR0 = (1 << WGM01) | (1 << CS02);
+    OCR0 = SCHED_TICK_OCR0;
+    TIMSK |= (1 << OCIE0);
+}
+
 void init_spi_slave(void) {
     SPI_DDR |= (1 << SPI_PIN_MISO);  // MISO 출력
     SPI_DDR &= ~((1 << SPI_PIN_SS) | (1 << SPI_PIN_SCK) | (1 << SPI_PIN_MOSI));  // 나머지 입력
@@ -261,8 +630,8 @@ void init_spi_slave(void) {
 
 void init_timer1_servo(void) {
     TCCR1A |= (1 << COM1A1) | (1 << WGM11);
-    TCCR1B |= (1 << WGM13) | (1 << WGM12) | (1 << CS11) | (1 << CS10);
-    ICR1 = 4999;  // 50Hz
+    TCCR1B |= (1 << WGM13) | (1 << WGM12) | SERVO_PRESCALER;
+    ICR1 = SERVO_ICR;  // 50Hz
 }
 
 void init_timer3_fan_pwm(void) {
@@ -270,47 +639,792 @@ void init_timer3_fan_pwm(void) {
     TCCR3B = (1 << WGM33) | (1 << WGM32);
     ICR3 = ICR_8KHZ;  // 8kHz
 }
+#endif
 
-void set_fan_speed(uint8_t level) {
-    switch (level) {
-        case 0: OCR3A = DUTY_HIGH; break;    // 미풍 (60%)
-        case 1: OCR3A = DUTY_MEDIUM; break;  // 약풍 (40%)
-        case 2: OCR3A = DUTY_LOW; break;     // 강풍 (20%)
+/* -------------------------------------------------------------------------- */
+/* 함수 정의 */
+/* -------------------------------------------------------------------------- */
+
+void init_state(void) {
+    // 서보 초기 위치
+    servo_current_ocr = SERVO_CENTER;
+    servo_target_ocr = SERVO_CENTER;
+    hal_servo_write(servo_current_ocr);
+
+    // 저장된 설정값 (없거나 깨졌으면 기본값), 램프 시간도 여기서 적용
+    params_load();
+
+    // 시스템 초기 상태
+    stop_fan();
+    user_ready_flag = 0;
+    servo_homing_required = 0;
+
+    // 첫 SPI 응답
+    spi_publish_status(1);
+}
+
+uint16_t sched_now(void) {
+    uint16_t ticks;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        ticks = sched_ticks;
+    }
+    return ticks;
+}
+
+uint16_t sched_timestamp(void) {
+    // 4us 단위 시각 (틱 x 250 + Timer0 카운트, 약 262ms마다 순환)
+    uint16_t now;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        now = sched_timestamp_nolock();
+    }
+    return now;
+}
+
+void scheduler_run(void) {
+    uint16_t now = sched_now();
+
+    for (uint8_t i = 0; i < SCHED_TASK_COUNT; i++) {
+        sched_task_t *task = &sched_tasks[i];
+        int16_t late = (int16_t)(now - task->next);
+        if (late < 0) continue;
+
+        if (late >= (int16_t)task->period) {
+            // 한 주기 이상 밀렸으면 따라잡지 않고 재정렬
+            sched_overruns++;
+            task->next = now + task->period;
+        } else {
+            task->next += task->period;
+        }
+
+        uint16_t start = sched_timestamp();
+        task->run();
+        uint16_t elapsed = sched_timestamp() - start;
+        if (elapsed > task->wcet) task->wcet = elapsed;
+    }
+}
+
+void task_servo(void) {
+    if (motor_running) {
+        // 작동 중: SPI 목표 따라가기
+        servo_slew_update(servo_target_ocr);
+    } else if (servo_homing_required || user_ready_flag == 1) {
+        // 정지 중: 90도 복귀
+        servo_slew_update(SERVO_CENTER);
+        if (servo_current_ocr == SERVO_CENTER) {
+            servo_homing_required = 0;  // 90도 도착 완료
+        }
+    } else {
+        servo_velocity = 0;
+    }
+}
+
+void task_buttons(void) {
+    uint8_t button_event;
+
+    // 눌린 버튼만 디바운스 진행
+    for (uint8_t i = 0; i < BUTTON_COUNT; i++) {
+        if (button_state[i] != BUTTON_IDLE) {
+            button_tick(i);
+        }
+    }
+
+    while (button_pop_event(&button_event)) {
+        uint8_t button = button_event & ~BUTTON_EVT_LONG;
+
+        if (button == BUTTON_TOGGLE && !(button_event & BUTTON_EVT_LONG)) {
+            // PD1: 시스템 ON/OFF
+            if (user_ready_flag == 1) {
+                // 켜져있으면 끄기
+                user_ready_flag = 0;
+                if (motor_running) {
+                    stop_fan();
+                }
+                servo_homing_required = 1;
+            } else {
+                // 꺼져있으면 켜기 (90도 복귀 시작)
+                user_ready_flag = 1;
+                servo_set_target(SERVO_CENTER);
+                servo_homing_required = 1;
+            }
+        } else if (button == BUTTON_SPEED && motor_running) {
+            // PD0: 누르면 다음 단계, 길게 누르면 강풍으로 바로 이동
+            if (button_event & BUTTON_EVT_LONG) {
+                speed_level = 2;
+            } else {
+                speed_level++;
+                if (speed_level > 2) speed_level = 0;
+            }
+            set_fan_speed(speed_level);
+        }
+    }
+}
+
+void task_status(void) {
+    if (motor_running) {
+        current_spi_status = STATUS_RUNNING;  // 작동 중
+    } else if (user_ready_flag == 1 && servo_get_position() == SERVO_CENTER) {
+        current_spi_status = STATUS_READY;  // 준비 완료
+    } else {
+        current_spi_status = STATUS_HOMING_OFF;  // 정지/복귀 중
+    }
+
+    // 다음 SPI 응답 갱신
+    spi_publish_status(0);
+}
+
+void button_begin(uint8_t button) {
+    // 디바운스가 끝날 때까지 해당 외부 인터럽트는 끔 (채터링 에지 무시)
+    hal_button_irq(button, 0);
+    button_debounce[button] = 0;
+    button_state[button] = BUTTON_PRESSING;
+}
+
+void button_tick(uint8_t button) {
+    uint8_t pressed = hal_button_level(button);
+
+    switch (button_state[button]) {
+        case BUTTON_PRESSING:
+            if (!pressed) {
+                button_rearm(button);  // 잡음이었음
+            } else if (++button_debounce[button] >= BUTTON_DEBOUNCE_MS) {
+                button_hold[button] = 0;
+                button_state[button] = BUTTON_HELD;
+                button_push_event(button | BUTTON_EVT_PRESS);
+            }
+            break;
+
+        case BUTTON_HELD:
+            if (!pressed) {
+                button_debounce[button] = 0;
+                button_state[button] = BUTTON_RELEASING;
+            } else if (button_hold[button] < BUTTON_LONG_MS && ++button_hold[button] == BUTTON_LONG_MS) {
+                button_push_event(button | BUTTON_EVT_LONG);
+            }
+            break;
+
+        case BUTTON_RELEASING:
+            if (pressed) {
+                button_state[button] = BUTTON_HELD;  // 뗄 때 채터링
+            } else if (++button_debounce[button] >= BUTTON_DEBOUNCE_MS) {
+                button_rearm(button);
+            }
+            break;
+    }
+}
+
+void button_rearm(uint8_t button) {
+    // 대기 중 쌓인 플래그를 지우고 다시 외부 인터럽트 대기
+    button_state[button] = BUTTON_IDLE;
+    hal_button_irq(button, 1);
+}
+
+void button_push_event(uint8_t event) {
+    uint8_t head = button_queue_head;
+    uint8_t next = (head + 1) & (BUTTON_QUEUE_SIZE - 1);
+    if (next != button_queue_tail) {
+        button_queue[head] = event;
+        button_queue_head = next;
+    }
+}
+
+uint8_t button_pop_event(uint8_t *event) {
+    uint8_t tail = button_queue_tail;
+    if (tail == button_queue_head) return 0;
+    *event = button_queue[tail];
+    button_queue_tail = (tail + 1) & (BUTTON_QUEUE_SIZE - 1);
+    return 1;
+}
+
+void servo_slew_update(uint16_t target) {
+    // 사다리꼴 속도 프로파일: 가속 -> 최대 속도 유지 -> 목표 근처에서 감속
+    int16_t error = (int16_t)target - (int16_t)servo_current_ocr;
+    int16_t distance = (error < 0) ? -error : error;
+    int16_t speed = (servo_velocity < 0) ? -servo_velocity : servo_velocity;
+
+    if (distance == 0) {
+        servo_velocity = 0;
+        return;
     }
+
+    // 목표가 반대편으로 바뀌면 원래 방향으로 가속도만큼씩 감속해 멈춘 뒤 다시 가속
+    // (속도를 한 프레임에 +최대 -> -가속으로 뒤집지 않음)
+    if ((error > 0 && servo_velocity < 0) || (error < 0 && servo_velocity > 0)) {
+        speed = (speed > servo_slew_accel) ? speed - servo_slew_accel : 0;
+        servo_velocity = (servo_velocity < 0) ? -speed : speed;
+        servo_current_ocr += servo_velocity;
+        if (servo_current_ocr < SERVO_CCW_MAX) servo_current_ocr = SERVO_CCW_MAX;
+        if (servo_current_ocr > SERVO_CW_MAX) servo_current_ocr = SERVO_CW_MAX;
+        hal_servo_write(servo_current_ocr);
+        return;
+    }
+
+    // 현재 속도로 멈추는 데 필요한 거리 = v^2 / 2a (나눗셈 없이 비교)
+    if ((int32_t)distance * 2 * servo_slew_accel <= (int32_t)speed * speed) {
+        speed -= servo_slew_accel;
+        if (speed < servo_slew_accel) speed = servo_slew_accel;
+    } else {
+        speed += servo_slew_accel;
+        if (speed > servo_slew_max_step) speed = servo_slew_max_step;
+    }
+
+    if (speed > distance) speed = distance;
+
+    if (error > 0) {
+        servo_current_ocr += speed;
+        servo_velocity = speed;
+    } else {
+        servo_current_ocr -= speed;
+        servo_velocity = -speed;
+    }
+    hal_servo_write(servo_current_ocr);
+}
+
+uint16_t servo_get_position(void) {
+    uint16_t position;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        position = servo_current_ocr;
+    }
+    return position;
+}
+
+void set_fan_speed(uint8_t level) {
+    // 미풍 (60%) / 약풍 (40%) / 강풍 (20%) = 세기 0 / 50 / 100%
+    if (level > 2) return;
+    set_fan_power(level * (FAN_POWER_MAX / 2));
+}
+
+void set_fan_power(uint8_t power) {
+    // 목표만 바꾸고 실제 OCR3A는 task_fan_ramp가 천천히 따라감
+    if (power > FAN_POWER_MAX) power = FAN_POWER_MAX;
+    fan_power = power;
+    fan_base_ocr = params[PARAM_DUTY_WEAKEST] - (uint16_t)((uint32_t)FAN_OCR_RANGE * power / FAN_POWER_MAX);
+    fan_apply_target();
+    speed_level = (power + FAN_POWER_MAX / 4) / (FAN_POWER_MAX / 2);
     update_leds();
 }
 
+void set_fan_ramp_time(uint16_t ramp_ms) {
+    // 0이면 즉시 적용
+    uint16_t step = FAN_OCR_RANGE;
+    if (ramp_ms > 0) {
+        step = (uint32_t)FAN_OCR_RANGE * TASK_PERIOD_FAN / ramp_ms;
+        if (step == 0) step = 1;
+    }
+    fan_ramp_step = step;
+}
+
+void fan_apply_target(void) {
+    // 세기 기준값 + PI 보정 (OCR이 작을수록 셈)
+    int16_t ocr = (int16_t)fan_base_ocr - fan_trim;
+    if (ocr < (int16_t)FAN_OCR_STRONGEST) ocr = FAN_OCR_STRONGEST;
+    if (ocr > (int16_t)FAN_OCR_WEAKEST) ocr = FAN_OCR_WEAKEST;
+    fan_target_ocr = ocr;
+}
+
+void task_fan_ramp(void) {
+    uint16_t ocr = fan_duty_ocr;
+    uint16_t target = fan_target_ocr;
+
+    if (ocr < target) {
+        ocr = (target - ocr > fan_ramp_step) ? ocr + fan_ramp_step : target;
+    } else if (ocr > target) {
+        ocr = (ocr - target > fan_ramp_step) ? ocr - fan_ramp_step : target;
+    }
+    if (ocr != fan_duty_ocr) {
+        fan_duty_ocr = ocr;
+        hal_fan_write(ocr);
+    }
+
+    if (fan_stopping && ocr == target) {
+        // 미풍까지 내려왔으면 출력 차단
+        fan_stopping = 0;
+        hal_fan_output(0);
+    }
+}
+
 void update_leds(void) {
-    LED_PORT &= ~((1 << LED_LOW_PIN) | (1 << LED_MEDIUM_PIN) | (1 << LED_HIGH_PIN));
-    if (!motor_running) return;
-
-    switch (speed_level) {
-        case 2:
-            LED_PORT |= (1 << LED_HIGH_PIN);
-        case 1:
-            LED_PORT |= (1 << LED_MEDIUM_PIN);
-        case 0:
-            LED_PORT |= (1 << LED_LOW_PIN);
-            break;
+    uint8_t leds = 0;
+
+    if (motor_running) {
+        switch (speed_level) {
+            case 2:
+                leds |= 0x04;  // 강풍
+            case 1:
+                leds |= 0x02;  // 약풍
+            case 0:
+                leds |= 0x01;  // 미풍
+                break;
+        }
+    }
+    hal_leds_write(leds);
+}
+
+void task_fan_rpm(void) {
+    uint16_t period_sum;
+    uint8_t pulses;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        period_sum = tach_last - tach_start;
+        pulses = tach_pulse_count;
+        tach_pulse_count = 0;
+    }
+
+    if (pulses > 0) {
+        // RPM = 60 x 펄스 주파수 / 회전당 펄스
+        fan_rpm = (60UL * SCHED_TIMESTAMP_HZ * pulses) / ((uint32_t)period_sum * FAN_TACH_PULSES_PER_REV);
+        fan_idle_ms = 0;
+        fan_stalled = 0;
+        fan_tach_seen = 1;
+    } else {
+        if (fan_idle_ms < FAN_STALL_MS) fan_idle_ms += TASK_PERIOD_RPM;
+        if (fan_idle_ms >= 2 * TASK_PERIOD_RPM) {
+            // 시각이 262ms마다 순환하므로 오래된 펄스 시각은 버림
+            fan_rpm = 0;
+            tach_valid = 0;
+        }
+    }
+
+    if (!motor_running || fan_stopping) {
+        fan_run_ms = 0;
+        fan_stalled = 0;
+        return;
+    }
+    if (fan_run_ms < FAN_SPINUP_MS) {
+        fan_run_ms += TASK_PERIOD_RPM;
+        return;
+    }
+    if (!fan_tach_seen) {
+        // FG 선이 없거나 연결 안 됨: 정지로 보거나 회전수 0을 PI로 보정하면 최대 듀티로 감
+        return;
+    }
+
+    if (fan_idle_ms >= FAN_STALL_MS) {
+        // 구동 중인데 회전 없음: 보고만 하고 적분은 멈춤 (최대 듀티로 발산 방지)
+        fan_stalled = 1;
+        fan_trim = 0;
+        fan_rpm_integral = 0;
+        fan_apply_target();
+        return;
+    }
+
+#if FAN_RPM_CONTROL
+    {
+        int16_t target_rpm = FAN_RPM_AT_MIN +
+            (int16_t)((int32_t)(FAN_RPM_AT_MAX - FAN_RPM_AT_MIN) * fan_power / FAN_POWER_MAX);
+        int16_t error = target_rpm - (int16_t)fan_rpm;
+        int32_t trim;
+
+        fan_rpm_integral += error;
+        if (fan_rpm_integral > (int32_t)FAN_TRIM_MAX * FAN_PI_KI_DIV) fan_rpm_integral = (int32_t)FAN_TRIM_MAX * FAN_PI_KI_DIV;
+        if (fan_rpm_integral < -(int32_t)FAN_TRIM_MAX * FAN_PI_KI_DIV) fan_rpm_integral = -(int32_t)FAN_TRIM_MAX * FAN_PI_KI_DIV;
+
+        trim = error / FAN_PI_KP_DIV + fan_rpm_integral / FAN_PI_KI_DIV;
+        if (trim > FAN_TRIM_MAX) trim = FAN_TRIM_MAX;
+        if (trim < -FAN_TRIM_MAX) trim = -FAN_TRIM_MAX;
+        fan_trim = trim;
+        fan_apply_target();
     }
+#endif
 }
 
 void start_fan(void) {
     motor_running = 1;
-    speed_level = 0;
-    
-    TCCR3A |= (1 << COM3A1);
-    set_fan_speed(speed_level);
-    TCCR3B |= (1 << CS30);
+    fan_run_ms = 0;
+    fan_trim = 0;
+    fan_rpm_integral = 0;
+
+    if (fan_stopping) {
+        // 정지 램프 중이면 출력이 살아있으므로 지금 듀티에서 이어서 올림
+        fan_stopping = 0;
+    } else {
+        // 미풍 듀티에서 출발
+        fan_duty_ocr = params[PARAM_DUTY_WEAKEST];
+        hal_fan_write(fan_duty_ocr);
+        hal_fan_output(1);
+    }
+    set_fan_speed(0);
 }
 
 void stop_fan(void) {
     motor_running = 0;
-    
-    TCCR3B &= ~(1 << CS30);
-    TCCR3A &= ~(1 << COM3A1);
-    FAN_PWM_PORT &= ~(1 << FAN_PWM_PIN);
-    
+    fan_trim = 0;
+    fan_rpm_integral = 0;
+
+    // 미풍까지 램프로 내린 뒤 task_fan_ramp가 출력 차단 (출력이 꺼져 있으면 바로 끝남)
+    fan_stopping = hal_fan_output_enabled();
+    set_fan_power(0);
     speed_level = 0;
     update_leds();
-}
\ No newline at end of file
+}
+
+uint8_t crc8(const uint8_t *data, uint8_t length) {
+    // CRC-8 (다항식 0x07, 초기값 0x00)
+    uint8_t crc = 0;
+    while (length--) {
+        crc ^= *data++;
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+uint16_t angle10_to_ocr(uint16_t angle10) {
+    // 1도 단위는 표에서, 0.1도는 인접 값 보간 (x * 6554 >> 16 = x / 10, 0~1600 범위에서 정확)
+    uint16_t offset = angle10 - SERVO_ANGLE10_MIN;
+    uint8_t degree = ((uint32_t)offset * 6554) >> 16;
+    uint8_t tenth = offset - degree * 10;
+    uint16_t ocr = pgm_read_word(&servo_angle_table[degree]);
+
+    if (tenth) {
+        uint16_t delta = pgm_read_word(&servo_angle_table[degree + 1]) - ocr;
+        ocr += ((uint32_t)delta * tenth * 6554 + 32768) >> 16;
+    }
+    return ocr >> SERVO_LUT_SHIFT;
+}
+
+uint16_t ocr_to_angle10(uint16_t ocr) {
+    return (uint32_t)(ocr - SERVO_CCW_MAX) * (SERVO_ANGLE10_MAX - SERVO_ANGLE10_MIN)
+           / (SERVO_CW_MAX - SERVO_CCW_MAX) + SERVO_ANGLE10_MIN;
+}
+
+void servo_set_target(uint16_t ocr) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        servo_target_ocr = ocr;
+    }
+}
+
+void spi_poll_frames(void) {
+    static uint8_t frame[SPI_FRAME_LEN];
+    static uint8_t length = 0;
+
+    while (spi_rx_tail != spi_rx_head) {
+        uint8_t byte = spi_rx_ring[spi_rx_tail];
+        spi_rx_tail = (spi_rx_tail + 1) & (SPI_RX_RING_SIZE - 1);
+
+        if (length == 0 && byte != SPI_CMD_HEADER) continue;
+        frame[length++] = byte;
+
+        if (length == SPI_FRAME_LEN) {
+            length = 0;
+            spi_handle_frame(frame);
+        }
+    }
+
+    // SS가 HIGH면 프레임 사이: 바이트가 빠졌거나(오버런, 잡음, 버스트 중 리셋) 더 들어왔어도
+    // 다음 프레임은 처음부터 (ISR 위치와 조립 중인 프레임을 모두 버림)
+    if ((spi_frame_pos != 0 || length != 0) && !hal_spi_selected()) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            // 마지막 바이트의 ISR이 아직이거나 링에 남은 바이트가 있으면 다음 루프에서
+            if (!hal_spi_selected() && !hal_spi_pending() && spi_rx_tail == spi_rx_head) {
+                spi_frame_pos = 0;
+                length = 0;
+                hal_spi_write(SPI_STATUS_HEADER);
+            }
+        }
+    }
+}
+
+void spi_handle_frame(const uint8_t *frame) {
+    uint8_t opcode = frame[1];
+    uint16_t value = frame[2] | ((uint16_t)frame[3] << 8);
+    uint8_t speed = frame[4];
+    uint8_t slew = frame[5];
+    uint8_t result = ACK_OK;
+
+    // RPi가 상태 프레임을 읽어갔으므로 알림 해제
+    hal_status_irq(0);
+
+    if (crc8(&frame[1], SPI_FRAME_LEN - 2) != frame[SPI_FRAME_LEN - 1]) {
+        // 시퀀스도 믿을 수 없으므로 결과만 갱신
+        spi_ack_result = ACK_CRC_ERROR;
+        spi_publish_status(1);
+        return;
+    }
+
+    switch (opcode) {
+        case OP_POLL:
+            // 상태 조회 (응답만 보냄)
+            break;
+
+        case OP_START:
+            // 팬 시작
+            if (current_spi_status == STATUS_READY) {
+                start_fan();
+                current_spi_status = STATUS_RUNNING;
+            } else {
+                result = ACK_REJECTED;
+            }
+            break;
+
+        case OP_RESET:
+            // 리셋 (자동 정지)
+            if (motor_running) {
+                stop_fan();
+            }
+            user_ready_flag = 0;
+            servo_homing_required = 1;  // 90도 복귀 시작
+            current_spi_status = STATUS_HOMING_OFF;
+            break;
+
+        case OP_TRACK:
+        case OP_SET_OCR:
+            // 작동 중이고 준비 상태일 때만 각도 명령 수신
+            if (user_ready_flag != 1 || !motor_running) {
+                result = ACK_REJECTED;
+                break;
+            }
+            if (opcode == OP_TRACK) {
+                if (value < params[PARAM_ANGLE10_MIN] || value > params[PARAM_ANGLE10_MAX]) {
+                    result = ACK_REJECTED;
+                    break;
+                }
+                value = angle10_to_ocr(value);
+            } else if (value < angle10_to_ocr(params[PARAM_ANGLE10_MIN]) ||
+                       value > angle10_to_ocr(params[PARAM_ANGLE10_MAX])) {
+                result = ACK_REJECTED;
+                break;
+            }
+            servo_set_target(value);
+            spi_echo = frame[6] | ((uint16_t)frame[7] << 8);
+            spi_echo_param = 0;
+
+            if (speed & SPEED_POWER_FLAG) {
+                if (speed != SPEED_KEEP && (speed & ~SPEED_POWER_FLAG) != fan_power) {
+                    set_fan_power(speed & ~SPEED_POWER_FLAG);
+                }
+            } else if (speed <= 2 && speed * (FAN_POWER_MAX / 2) != fan_power) {
+                set_fan_speed(speed);
+            }
+            // 명령의 슬루는 이번 목표까지의 임시 상한 (EEPROM 설정 PARAM_SLEW_MAX_STEP을 넘지 않음)
+            if (slew == SLEW_KEEP || slew > params[PARAM_SLEW_MAX_STEP]) {
+                slew = params[PARAM_SLEW_MAX_STEP];
+            }
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                servo_slew_max_step = (uint16_t)slew * SERVO_OCR_SCALE;
+            }
+            break;
+
+        case OP_SET_FAN_RAMP:
+            // 램프 시간 (상태와 무관하게 적용, 저장은 OP_SAVE_PARAMS)
+            result = param_set(PARAM_FAN_RAMP_MS, value);
+            break;
+
+        case OP_SET_PARAM:
+            // 설정값 (상태와 무관하게 바로 적용)
+            result = (speed < PARAM_COUNT) ? param_set(speed, value) : ACK_REJECTED;
+            break;
+
+        case OP_GET_PARAM:
+            if (speed < PARAM_COUNT) {
+                spi_echo = params[speed];
+                spi_echo_param = 1;
+            } else {
+                result = ACK_REJECTED;
+            }
+            break;
+
+        case OP_SAVE_PARAMS:
+            if (value == 1) {
+                params_defaults();
+            }
+            params_save();
+            break;
+
+        default:
+            result = ACK_BAD_OPCODE;
+            break;
+    }
+
+    spi_ack_seq = frame[SPI_FRAME_LEN - 2];
+    spi_ack_result = result;
+    spi_publish_status(1);
+}
+
+void spi_publish_status(uint8_t force) {
+    static uint8_t last_status = 0xFF;
+    static uint16_t last_position = 0xFFFF;
+    static uint8_t last_speed = 0xFF;
+    static uint16_t last_rpm = 0xFFFF;
+    uint16_t position = servo_get_position();
+    uint8_t speed = speed_level | (fan_stalled ? SPEED_FLAG_STALL : 0) |
+                    (spi_echo_param ? SPEED_FLAG_PARAM : 0);
+    uint16_t angle10;
+    uint8_t frame[SPI_FRAME_LEN];
+    uint8_t status_changed = (last_status != current_spi_status);
+    uint8_t i;
+
+    if (!force && last_status == current_spi_status &&
+        last_position == position && last_speed == speed && last_rpm == fan_rpm) {
+        return;
+    }
+    last_status = current_spi_status;
+    last_position = position;
+    last_speed = speed;
+    last_rpm = fan_rpm;
+
+    angle10 = ocr_to_angle10(position);
+    frame[0] = SPI_STATUS_HEADER;
+    frame[1] = current_spi_status;
+    frame[2] = spi_ack_seq;
+    frame[3] = spi_ack_result;
+    frame[4] = angle10 & 0xFF;
+    frame[5] = angle10 >> 8;
+    frame[6] = speed;
+    frame[7] = fan_rpm & 0xFF;
+    frame[8] = fan_rpm >> 8;
+    frame[9] = spi_echo & 0xFF;
+    frame[10] = spi_echo >> 8;
+    frame[SPI_FRAME_LEN - 1] = crc8(&frame[1], SPI_FRAME_LEN - 2);
+
+    // ISR이 교체하지 못하게 막고 비활성 버퍼를 채움
+    spi_tx_pending = 0;
+    for (i = 0; i < SPI_FRAME_LEN; i++) {
+        spi_tx_buf[spi_tx_active ^ 1][i] = frame[i];
+    }
+    spi_tx_pending = 1;
+
+    // 프레임이 준비된 뒤에 알려야 RPi가 새 상태를 바로 읽음
+    if (status_changed) {
+        hal_status_irq(1);
+    }
+}
+
+void params_defaults(void) {
+    uint8_t i;
+
+    params[PARAM_SLEW_MAX_STEP] = SERVO_SLEW_MAX_STEP / SERVO_OCR_SCALE;
+    params[PARAM_SLEW_ACCEL] = SERVO_SLEW_ACCEL / SERVO_OCR_SCALE;
+    params[PARAM_ANGLE10_MIN] = SERVO_ANGLE10_MIN;
+    params[PARAM_ANGLE10_MAX] = SERVO_ANGLE10_MAX;
+    params[PARAM_DUTY_WEAKEST] = DUTY_HIGH;
+    params[PARAM_DUTY_STRONGEST] = DUTY_LOW;
+    params[PARAM_FAN_RAMP_MS] = FAN_RAMP_TIME_MS;
+    for (i = 0; i < PARAM_COUNT; i++) {
+        params_apply(i);
+    }
+}
+
+void params_load(void) {
+    uint8_t i, pass;
+
+    params_defaults();
+    for (i = 0; i < PARAMS_IMAGE_LEN; i++) {
+        params_image[i] = hal_eeprom_read(PARAMS_EEPROM_ADDR + i);
+    }
+    if (params_image[0] != PARAMS_MAGIC ||
+        crc8(params_image, PARAMS_IMAGE_LEN - 1) != params_image[PARAMS_IMAGE_LEN - 1]) {
+        // 처음 켰거나 저장 중에 전원이 꺼짐 -> 기본값 유지
+        return;
+    }
+
+    // 듀티 상/하한은 서로를 기준으로 검사하므로 두 번 적용 (범위를 벗어난 값은 기본값 유지)
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < PARAM_COUNT; i++) {
+            param_set(i, params_image[1 + 2 * i] | ((uint16_t)params_image[2 + 2 * i] << 8));
+        }
+    }
+}
+
+void params_save(void) {
+    // 블록만 만들어 두고 task_eeprom이 나눠서 씀 (쓰는 중에 다시 저장하면 처음부터)
+    uint8_t i;
+
+    params_image[0] = PARAMS_MAGIC;
+    for (i = 0; i < PARAM_COUNT; i++) {
+        params_image[1 + 2 * i] = params[i] & 0xFF;
+        params_image[2 + 2 * i] = params[i] >> 8;
+    }
+    params_image[PARAMS_IMAGE_LEN - 1] = crc8(params_image, PARAMS_IMAGE_LEN - 1);
+    params_write_pos = 0;
+}
+
+uint8_t param_set(uint8_t id, uint16_t value) {
+    // 범위를 벗어나면 거부 (기존 값 유지), 맞으면 바로 적용
+    switch (id) {
+        case PARAM_SLEW_MAX_STEP:
+        case PARAM_SLEW_ACCEL:
+            if (value < 1 || value > 255) return ACK_REJECTED;
+            break;
+
+        case PARAM_ANGLE10_MIN:
+            if (value < SERVO_ANGLE10_MIN || value > SERVO_ANGLE10_CENTER) return ACK_REJECTED;
+            break;
+
+        case PARAM_ANGLE10_MAX:
+            if (value < SERVO_ANGLE10_CENTER || value > SERVO_ANGLE10_MAX) return ACK_REJECTED;
+            break;
+
+        case PARAM_DUTY_WEAKEST:
+            // OCR이 작을수록 셈 -> 최약 > 최강
+            if (value <= params[PARAM_DUTY_STRONGEST] || value > FAN_OCR_WEAKEST) return ACK_REJECTED;
+            break;
+
+        case PARAM_DUTY_STRONGEST:
+            if (value < FAN_OCR_STRONGEST || value >= params[PARAM_DUTY_WEAKEST]) return ACK_REJECTED;
+            break;
+
+        case PARAM_FAN_RAMP_MS:
+            if (value > FAN_RAMP_TIME_MAX) return ACK_REJECTED;
+            break;
+
+        default:
+            return ACK_REJECTED;
+    }
+
+    params[id] = value;
+    params_apply(id);
+    return ACK_OK;
+}
+
+void params_apply(uint8_t id) {
+    uint16_t low, high;
+
+    switch (id) {
+        case PARAM_SLEW_MAX_STEP:
+            // 각도 명령의 슬루 값은 이 값 이하로만 적용됨
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                servo_slew_max_step = params[id] * SERVO_OCR_SCALE;
+            }
+            break;
+
+        case PARAM_SLEW_ACCEL:
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                servo_slew_accel = params[id] * SERVO_OCR_SCALE;
+            }
+            break;
+
+        case PARAM_ANGLE10_MIN:
+        case PARAM_ANGLE10_MAX:
+            // 이미 받은 목표가 새 범위 밖이면 경계로
+            low = angle10_to_ocr(params[PARAM_ANGLE10_MIN]);
+            high = angle10_to_ocr(params[PARAM_ANGLE10_MAX]);
+            if (servo_target_ocr < low) servo_set_target(low);
+            if (servo_target_ocr > high) servo_set_target(high);
+            break;
+
+        case PARAM_DUTY_WEAKEST:
+        case PARAM_DUTY_STRONGEST:
+            // 세기 -> OCR 기준값과 램프 기울기를 새 구간으로 다시 계산
+            set_fan_power(fan_power);
+            set_fan_ramp_time(params[PARAM_FAN_RAMP_MS]);
+            break;
+
+        case PARAM_FAN_RAMP_MS:
+            set_fan_ramp_time(params[id]);
+            break;
+    }
+}
+
+void task_eeprom(void) {
+    // 바이트 쓰기는 기다리지 않고 시작만 (같은 값은 건너뛰어 쓰기 횟수 절약)
+    while (params_write_pos < PARAMS_IMAGE_LEN && hal_eeprom_ready()) {
+        uint16_t addr = PARAMS_EEPROM_ADDR + params_write_pos;
+        uint8_t data = params_image[params_write_pos++];
+
+        if (hal_eeprom_read(addr) != data) {
+            hal_eeprom_write(addr, data);
+            break;
+        }
+    }
+}
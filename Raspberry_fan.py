@@ -1,357 +1,2892 @@
+import argparse
+import csv
+import ctypes
+import fcntl
+import glob
+import json
+import math
+import os
+import signal
+import socket
+import socketserver
+import struct
+import sys
 import time
+import threading
+from collections import deque
+from multiprocessing import shared_memory
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
 import cv2
 import numpy as np
-import spidev
 
-# ------------------- SPI 초기화 -------------------
-spi = spidev.SpiDev()
-spi.open(0, 0)
-spi.max_speed_hz = 1000000
-spi.mode = 0
+# ------------------- 실행 옵션 -------------------
+# --replay: 카메라 대신 녹화 영상/이미지 폴더 재생 + 모의 SPI (하드웨어 없이 같은 코드 경로로 벤치마크)
+parser = argparse.ArgumentParser(description='스마트 팬 제어 (라즈베리파이)')
+parser.add_argument('--replay', nargs='+', help='동영상 파일 또는 이미지 폴더를 카메라 대신 재생 (벤치마크 모드, 카메라마다 1개)')
+parser.add_argument('--replay-fps', type=float, default=0, help='재생 속도 (0: 원본 fps)')
+parser.add_argument('--lockstep', action='store_true', help='추론이 이전 프레임을 가져간 뒤에 다음 프레임 공급 (드롭 없음)')
+parser.add_argument('--mock-spi', action='store_true', help='ATmega 대신 모의 SPI 응답 사용 (--replay면 자동)')
+parser.add_argument('--backend', help='INFERENCE_BACKEND 대신 사용할 백엔드')
+parser.add_argument('--input-size', type=int, help='input_size 대신 사용할 추론 입력 크기')
+parser.add_argument('--trace', default='bench_trace.csv', help='벤치마크 각도 명령 기록 CSV')
+parser.add_argument('--config', default='smart_fan.json', help='설정 파일 (JSON, 없으면 기본값)')
+parser.add_argument('--serve', action='store_true', help='추론 서비스로 실행 (모델을 한 번 올려 두고 소켓으로 추론, 제어 쪽은 --backend service)')
+args = parser.parse_args()
+
+BENCHMARK = args.replay is not None
+MOCK_SPI = args.mock_spi or BENCHMARK
+
+# ------------------- 설정 파일 -------------------
+# {"이름": 값} 형식이고 이름은 아래 설정 절의 전역 변수 이름 그대로 (예: "confidence_threshold", "MOVE_SPEED")
+# 각 설정 절 끝에서 apply_config()가 그때까지 정의된 이름만 덮어쓴다 (명령행 옵션이 설정 파일보다 우선)
+# dict 값(MODEL_PATHS 등)은 통째로 바꾸지 않고 합친다. "_"로 시작하는 이름은 주석으로 보고 무시
+def read_config(path):
+    """설정 파일(JSON 객체) 읽기. 파일이 없으면 빈 설정"""
+    if not path or not os.path.exists(path):
+        return {}
+    with open(path) as f:
+        config = json.load(f)
+    if not isinstance(config, dict):
+        raise SystemExit(f"오류: 설정 파일은 JSON 객체여야 합니다 ({path})")
+    return {name: value for name, value in config.items() if not name.startswith('_')}
+
+
+def convert_config_value(name, value):
+    """JSON 값을 현재 전역 값과 같은 형식으로 바꾼다 (형식이 다르면 ValueError)"""
+    current = globals()[name]
+    number = isinstance(value, (int, float)) and not isinstance(value, bool)
+    if current is None:
+        return value
+    if isinstance(current, bool):
+        if isinstance(value, bool):
+            return value
+    elif isinstance(current, int):
+        if number and value == int(value):
+            return int(value)
+    elif isinstance(current, float):
+        if number:
+            return float(value)
+    elif isinstance(current, str):
+        if isinstance(value, str):
+            return value
+    elif isinstance(current, (tuple, list)):
+        if isinstance(value, list):
+            return type(current)(value)
+    elif isinstance(current, dict):
+        if isinstance(value, dict):
+            return dict(current, **value)
+    else:
+        raise ValueError("설정값이 아님")
+    raise ValueError(f"{type(current).__name__} 값이어야 함 ({value!r})")
+
+
+def apply_config(final=False):
+    """설정 파일 값 중 지금까지 정의된 이름을 덮어쓴다. final이면 남은(모르는) 이름을 알림"""
+    for name in [name for name in pending_config if name in globals()]:
+        value = pending_config.pop(name)
+        try:
+            globals()[name] = convert_config_value(name, value)
+        except ValueError as e:
+            print(f"⚠ 설정 {name} 무시: {e}")
+    if final:
+        for name in pending_config:
+            print(f"⚠ 알 수 없는 설정 무시: {name}")
+        pending_config.clear()
+
+
+pending_config = read_config(args.config)
+if pending_config:
+    print(f"✓ 설정 파일: {args.config} ({len(pending_config)}개)")
+
+# ------------------- SPI 설정 -------------------
+SPI_SPEED_HZ = 1000000  # 바이트 8us (ATmega 슬레이브는 송신 버퍼가 없어 바이트마다 ISR이 SPDR을 다시 채워야 함)
+SPI_BYTE_DELAY_US = 16  # 바이트 사이 간격: 가장 긴 다른 ISR 뒤에도 SPI ISR이 다음 응답 바이트를 넣을 시간 (fan_sim.c -g)
+                        # 12바이트 버스트 = 12 x 8 + 11 x 16 = 272us (기존 1바이트 명령은 8us)
+
+# ATmega 상태 변경 알림 핀 (PC3 -> 분압 -> BCM GPIO). 없으면 폴링으로 동작
+STATUS_IRQ_ENABLED = True
+STATUS_SAFETY_POLL = 2.0   # 알림을 놓쳐도 이 간격으로는 상태 확인 (초)
+
+# 팬 목록 (ATmega 1대 = SPI 칩 셀렉트 1개, 팬마다 상태 머신/제어 스레드가 따로 돈다)
+# spi: (버스, CS), status_gpio: 상태 알림 핀 BCM 번호 (None이면 폴링)
+# region: 이 팬이 맡는 화면 가로 구간 (0~1 비율, 겹치면 같은 사람을 함께 조준할 수 있음)
+# camera_mounted: 카메라가 이 팬 머리에 달려 있으면 True (서보 각도로 카메라 회전을 보상)
+#                 False면 카메라가 고정돼 있고 팬이 근처에 있다고 보고 angle_offset만 더함
+FANS = [
+    {'name': 'fan0', 'spi': (0, 0), 'status_gpio': 25, 'region': (0.0, 1.0),
+     'camera_mounted': True, 'angle_offset': 0.0},
+]
+
+# ATmega 런타임 설정: 팬마다 시작할 때 OP_SET_PARAM으로 보내고 EEPROM에 저장 (비어 있으면 ATmega에 저장된 값 유지)
+# slew_max_step, slew_accel: 기존 4us OCR 카운트/프레임, angle10_min/max: 각도 명령 범위 (0.1도, 90도 포함)
+# duty_weakest, duty_strongest: 세기 0%/100%의 OCR3A (듀티 반전이라 작을수록 셈), fan_ramp_ms: 최약 -> 최강 램프
+FIRMWARE_PARAMS = {}
+FIRMWARE_ACK_RETRIES = 3    # ack가 안 보이면 같은 명령을 다시 보내는 횟수 (설정/조회/저장은 다시 보내도 같음)
+apply_config()
+MULTI_FAN = len(FANS) > 1  # 여러 대면 ROI/광류 없이 매 프레임 전체 탐지 (대상이 여러 명)
+
+# ------------------- 카메라 목록 -------------------
+# 여러 대면 프레임을 배치 blob(N x 3 x input_size x input_size) 하나로 묶어 추론 1회
+# device: V4L2 장치 번호, yaw: 카메라 중심 방향 (도, 팬 정면 기준 +: 오른쪽), hfov: 수평 화각 (도)
+# 여러 대는 고정 설치(팬 머리에 달지 않음, 같은 해상도)로 보고, 탐지 결과는 yaw/hfov로
+# 공유 각도 좌표(파노라마 캔버스, 가운데 = 팬 정면)에 놓여 팬이 탐색 없이 바로 조준한다
+CAMERAS = [
+    {'device': 0, 'yaw': 0.0, 'hfov': 62.2},  # Pi Camera v2
+]
+apply_config()
+MULTI_CAMERA = len(CAMERAS) > 1
+
+# 종료 신호 (모듈 로드 중 만드는 추론 백엔드도 재연결 대기에서 보므로 백엔드보다 먼저)
+stop_event = threading.Event()
+
+# ------------------- 추론 백엔드 -------------------
+# 'service': --serve로 따로 띄운 추론 서비스에 blob을 보냄 (모델을 서비스가 한 번만 올리고 워밍업해 두므로
+#            제어 스크립트는 모델 로드 없이 바로 시작하고, 재시작해도 서비스에 다시 연결만 함)
+INFERENCE_BACKEND = 'opencv'  # 'opencv', 'onnxruntime', 'tflite', 'ncnn', 'service'
+MODEL_PATHS = {
+    'opencv': 'yolov8n.onnx',
+    'onnxruntime': 'yolov8n_person_int8.onnx',   # build_person_model.py 로 생성
+    'tflite': 'yolov8n_person_int8.tflite',
+    'ncnn': 'yolov8n_person_ncnn_model',         # model.ncnn.param / model.ncnn.bin 폴더
+    'service': '/tmp/smart_fan_infer.sock',      # 추론 서비스 소켓 (--serve 쪽도 같은 경로)
+}
+INFERENCE_SERVICE_RETRY = 5.0  # 시작할 때 서비스 연결을 기다리는 시간 (초, 실행 중 끊기면 계속 다시 연결)
+WARMUP_RUNS = 3
+NUM_THREADS = 4
+input_size = 160
+SEARCH_INPUT_SIZE = 96  # SEARCHING 스캔 중 추론 입력 (작을수록 빠름, 0: 사용 안 함, 동적 입력 모델만)
+apply_config()
+if args.backend:
+    INFERENCE_BACKEND = args.backend
+if args.input_size:
+    input_size = args.input_size
+
+
+class InferenceBackend:
+    """blob(Nx3xHxW, float32) -> YOLOv8 출력 (N, 4 + 클래스 수, 앵커 수)"""
+
+    name = 'base'
+    batched = True  # False: 배치를 한 장씩 나눠 forward (모델 입력이 배치 1 고정일 때)
+
+    def forward(self, blob):
+        raise NotImplementedError
+
+    def infer(self, blob):
+        if self.batched or blob.shape[0] == 1:
+            return self.forward(blob)
+        return np.concatenate([self.forward(blob[i:i + 1]) for i in range(blob.shape[0])])
+
+    def warmup(self, runs=WARMUP_RUNS, batch=1, size=None):
+        # 첫 추론은 메모리 할당/커널 선택 때문에 느리므로 미리 돌려둔다
+        size = size or input_size
+        dummy = np.zeros((batch, 3, size, size), dtype=np.float32)
+        try:
+            outputs = self.infer(dummy)
+        except Exception as e:
+            if not self.batched or batch == 1:
+                raise
+            # 배치 1로 내보낸 모델 (build_person_model.py --dynamic-batch 로 다시 만들면 배치 추론)
+            print(f"⚠ 모델이 배치 {batch} 입력을 받지 않아 카메라별로 나눠 추론 ({e.__class__.__name__})")
+            self.batched = False
+            outputs = self.infer(dummy)
+        for _ in range(runs - 1):
+            outputs = self.infer(dummy)
+        return outputs
+
+
+class OpenCVBackend(InferenceBackend):
+    name = 'opencv'
+
+    def __init__(self, model_path):
+        self.net = cv2.dnn.readNet(model_path)
+        self.output_names = self.net.getUnconnectedOutLayersNames()
+
+    def forward(self, blob):
+        self.net.setInput(blob)
+        return self.net.forward(self.output_names)[0]
+
+
+class OnnxRuntimeBackend(InferenceBackend):
+    name = 'onnxruntime'
+
+    def __init__(self, model_path):
+        import onnxruntime as ort
+        options = ort.SessionOptions()
+        options.graph_optimization_level = ort.GraphOptimizationLevel.ORT_ENABLE_ALL
+        options.intra_op_num_threads = NUM_THREADS
+        available = ort.get_available_providers()
+        providers = []
+        if 'XnnpackExecutionProvider' in available:
+            providers.append(('XnnpackExecutionProvider', {'intra_op_num_threads': NUM_THREADS}))
+        providers.append('CPUExecutionProvider')
+        self.session = ort.InferenceSession(model_path, sess_options=options, providers=providers)
+        self.input_name = self.session.get_inputs()[0].name
+
+    def forward(self, blob):
+        return self.session.run(None, {self.input_name: blob})[0]
+
+
+class TFLiteBackend(InferenceBackend):
+    name = 'tflite'
+    batched = False  # 입력 텐서 크기 고정 (배치 1)
+
+    def __init__(self, model_path):
+        try:
+            from tflite_runtime.interpreter import Interpreter
+        except ImportError:
+            from tensorflow.lite import Interpreter
+        self.interpreter = Interpreter(model_path=model_path, num_threads=NUM_THREADS)
+        self.interpreter.allocate_tensors()
+        self.input_detail = self.interpreter.get_input_details()[0]
+        self.output_detail = self.interpreter.get_output_details()[0]
+
+    def forward(self, blob):
+        # TFLite는 NHWC 입력, INT8 모델이면 양자화/역양자화
+        tensor = blob.transpose(0, 2, 3, 1)
+        scale, zero_point = self.input_detail['quantization']
+        if self.input_detail['dtype'] in (np.int8, np.uint8) and scale:
+            tensor = np.round(tensor / scale + zero_point).astype(self.input_detail['dtype'])
+        self.interpreter.set_tensor(self.input_detail['index'], tensor)
+        self.interpreter.invoke()
+        outputs = self.interpreter.get_tensor(self.output_detail['index'])
+        scale, zero_point = self.output_detail['quantization']
+        if self.output_detail['dtype'] in (np.int8, np.uint8) and scale:
+            outputs = (outputs.astype(np.float32) - zero_point) * scale
+        return outputs
+
+
+class NCNNBackend(InferenceBackend):
+    name = 'ncnn'
+    batched = False  # ncnn.Mat은 배치 차원이 없음
+
+    def __init__(self, model_path):
+        import ncnn
+        self.ncnn = ncnn
+        self.net = ncnn.Net()
+        self.net.opt.num_threads = NUM_THREADS
+        self.net.opt.use_int8_inference = True
+        self.net.load_param(f"{model_path}/model.ncnn.param")
+        self.net.load_model(f"{model_path}/model.ncnn.bin")
+
+    def forward(self, blob):
+        extractor = self.net.create_extractor()
+        extractor.input("in0", self.ncnn.Mat(blob[0]))
+        _, output = extractor.extract("out0")
+        return np.array(output)[None]
+
+
+# 추론 서비스 프레임 (유닉스 소켓, 헤더 뒤에 float32 배열 그대로)
+# 요청: 'SFRQ', 배치, 채널, 높이, 너비 + blob / 응답: 'SFRS', 오류, 배치, 채널, 앵커 수 + 출력
+# 오류면 앵커 수 자리에 메시지 길이, 뒤에 UTF-8 메시지
+INFER_REQUEST = struct.Struct('<4sHHHH')
+INFER_REPLY = struct.Struct('<4sHHHI')
+
+
+def recv_exact(sock, view):
+    """view(memoryview)가 찰 때까지 받는다 (연결이 끊기면 ConnectionError)"""
+    while view:
+        received = sock.recv_into(view)
+        if not received:
+            raise ConnectionError('추론 서비스 연결 끊김')
+        view = view[received:]
+
+
+class ServiceBackend(InferenceBackend):
+    """--serve 추론 서비스 클라이언트 (배치는 서비스 쪽 백엔드가 나눠서 처리)"""
+
+    name = 'service'
+
+    def __init__(self, socket_path):
+        self.socket_path = socket_path
+        self.sock = None
+        deadline = time.monotonic() + INFERENCE_SERVICE_RETRY
+        while not self.connect():
+            if time.monotonic() >= deadline:
+                raise SystemExit(f"오류: 추론 서비스 없음 ({socket_path}) - 먼저 python {sys.argv[0]} --serve 실행")
+            time.sleep(0.2)
+
+    def connect(self):
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        try:
+            sock.connect(self.socket_path)
+        except OSError:
+            sock.close()
+            return False
+        self.sock = sock
+        return True
+
+    def forward(self, blob):
+        # 서비스가 재시작되면 다시 연결될 때까지 기다렸다가 같은 blob을 다시 보냄 (모델은 서비스에 그대로)
+        while True:
+            try:
+                if self.sock is not None:
+                    return self.exchange(blob)
+            except OSError:
+                self.sock.close()
+                self.sock = None
+                print("⚠ 추론 서비스 연결 끊김, 다시 연결 중...")
+            while not self.connect():
+                if stop_event.wait(0.2):
+                    raise ConnectionError('종료 중')
+            print("✓ 추론 서비스 다시 연결")
+
+    def exchange(self, blob):
+        blob = np.ascontiguousarray(blob, dtype=np.float32)
+        self.sock.sendall(INFER_REQUEST.pack(b'SFRQ', *blob.shape))
+        self.sock.sendall(memoryview(blob).cast('B'))
+        header = bytearray(INFER_REPLY.size)
+        recv_exact(self.sock, memoryview(header))
+        magic, error, batch, channels, anchors = INFER_REPLY.unpack(header)
+        if magic != b'SFRS':
+            raise ConnectionError('추론 서비스 응답 형식 오류')
+        if error:
+            message = bytearray(anchors)
+            recv_exact(self.sock, memoryview(message))
+            raise RuntimeError(f"추론 서비스: {message.decode(errors='replace')}")
+        outputs = np.empty((batch, channels, anchors), dtype=np.float32)
+        recv_exact(self.sock, memoryview(outputs).cast('B'))
+        return outputs
+
+
+BACKENDS = {
+    'opencv': OpenCVBackend,
+    'onnxruntime': OnnxRuntimeBackend,
+    'tflite': TFLiteBackend,
+    'ncnn': NCNNBackend,
+    'service': ServiceBackend,
+}
+
+
+def create_backend(name, model_path=None):
+    backend = BACKENDS[name](model_path or MODEL_PATHS[name])
+    warm_start = time.time()
+    outputs = backend.warmup(batch=len(CAMERAS))
+    print(f"✓ 워밍업 완료 ({name}, 배치 {len(CAMERAS)}, {WARMUP_RUNS}회, {time.time() - warm_start:.2f}s)")
+    return backend, outputs.shape[1] - 4
+
+
+class InferenceServiceHandler(socketserver.StreamRequestHandler):
+    """--serve: 연결 하나에서 요청을 차례로 처리 (여러 연결이어도 추론은 한 번에 하나)"""
+
+    def handle(self):
+        while True:
+            header = self.rfile.read(INFER_REQUEST.size)
+            if len(header) < INFER_REQUEST.size:
+                return
+            magic, batch, channels, height, width = INFER_REQUEST.unpack(header)
+            if magic != b'SFRQ':
+                return
+            blob = np.empty((batch, channels, height, width), dtype=np.float32)
+            if self.rfile.readinto(memoryview(blob).cast('B')) < blob.nbytes:
+                return
+            try:
+                with inference_service_lock:
+                    outputs = np.ascontiguousarray(backend.infer(blob), dtype=np.float32)
+            except Exception as e:
+                # 입력 크기가 고정된 모델에 다른 크기를 보낸 경우 등: 클라이언트가 예외로 받음
+                message = f"{e.__class__.__name__}: {e}".encode()
+                self.wfile.write(INFER_REPLY.pack(b'SFRS', 1, 0, 0, len(message)) + message)
+                continue
+            self.wfile.write(INFER_REPLY.pack(b'SFRS', 0, *outputs.shape))
+            self.wfile.write(memoryview(outputs).cast('B'))
+
+
+def serve_inference():
+    """모델을 올려 둔 채로 MODEL_PATHS['service'] 소켓에서 추론 요청을 처리한다 (Ctrl+C/SIGTERM으로 종료)."""
+    path = MODEL_PATHS['service']
+    if os.path.exists(path):
+        os.unlink(path)
+    server = socketserver.ThreadingUnixStreamServer(path, InferenceServiceHandler)
+    server.daemon_threads = True
+    signal.signal(signal.SIGTERM, lambda signum, frame: sys.exit(0))
+    print(f"✓ 추론 서비스 대기: {path} (종료: Ctrl+C)")
+    try:
+        server.serve_forever()
+    except (KeyboardInterrupt, SystemExit):
+        pass
+    finally:
+        server.server_close()
+        os.unlink(path)
+        print("✓ 추론 서비스 종료")
+
+
+inference_service_lock = threading.Lock()
+
 
 # ------------------- 모델 로드 -------------------
 print("=" * 60)
-print("YOLOv8 모델 로딩 중...")
-model_path = 'yolov8n.onnx'
-net = cv2.dnn.readNet(model_path)
+print(f"YOLOv8 모델 로딩 중... (백엔드: {INFERENCE_BACKEND})")
+if args.serve and INFERENCE_BACKEND == 'service':
+    raise SystemExit("오류: --serve에는 실제 추론 백엔드가 필요합니다 (INFERENCE_BACKEND/--backend)")
+backend, num_model_classes = create_backend(INFERENCE_BACKEND)
 class_names = ['person', 'bicycle', 'car', 'motorcycle', 'airplane', 'bus', 'train', 'truck', 'boat', 'traffic light', 'fire hydrant', 'stop sign', 'parking meter', 'bench', 'bird', 'cat', 'dog', 'horse', 'sheep', 'cow', 'elephant', 'bear', 'zebra', 'giraffe', 'backpack', 'umbrella', 'handbag', 'tie', 'suitcase', 'frisbee', 'skis', 'snowboard', 'sports ball', 'kite', 'baseball bat', 'baseball glove', 'skateboard', 'surfboard', 'tennis racket', 'bottle', 'wine glass', 'cup', 'fork', 'knife', 'spoon', 'bowl', 'banana', 'apple', 'sandwich', 'orange', 'broccoli', 'carrot', 'hot dog', 'pizza', 'donut', 'cake', 'chair', 'couch', 'potted plant', 'bed', 'dining table', 'toilet', 'tv', 'laptop', 'mouse', 'remote', 'keyboard', 'cell phone', 'microwave', 'oven', 'toaster', 'sink', 'refrigerator', 'book', 'clock', 'vase', 'scissors', 'teddy bear', 'hair drier', 'toothbrush']
-print("✓ 모델 로드 완료!")
+if num_model_classes == 1:
+    class_names = ['person']  # person 단일 클래스 헤드 모델
+# 재탐색용 작은 입력: 입력 크기가 고정된 모델이면 실패하므로 미리 한 번 돌려서 확인
+search_input_size = 0
+if SEARCH_INPUT_SIZE and SEARCH_INPUT_SIZE != input_size:
+    try:
+        backend.warmup(runs=1, batch=len(CAMERAS), size=SEARCH_INPUT_SIZE)
+        search_input_size = SEARCH_INPUT_SIZE
+        print(f"✓ 재탐색 입력: {search_input_size}x{search_input_size}")
+    except Exception as e:
+        print(f"⚠ 모델 입력 크기 고정: 재탐색도 {input_size}x{input_size}로 추론 ({e.__class__.__name__})")
+print(f"✓ 모델 로드 완료! (클래스 {num_model_classes}개)")
 print("=" * 60)
+if args.serve:
+    # 추론 서비스: 카메라/SPI 없이 모델만 유지
+    serve_inference()
+    sys.exit(0)
 
 # ------------------- 카메라 설정 -------------------
-FRAME_WIDTH = 640
-FRAME_HEIGHT = 480
-cap = cv2.VideoCapture(0, cv2.CAP_V4L2)
-cap.set(cv2.CAP_PROP_FRAME_WIDTH, FRAME_WIDTH)
-cap.set(cv2.CAP_PROP_FRAME_HEIGHT, FRAME_HEIGHT)
-if not cap.isOpened():
-    print("오류: 카메라를 열 수 없습니다.")
+FRAME_WIDTH = 320          # 센서에서 바로 저해상도로 받음 (추론 입력은 160x160)
+FRAME_HEIGHT = 240
+CAPTURE_FOURCC = 'YUYV'    # 'YUYV'(무압축, 디코딩 없음) 또는 'MJPG'
+CAPTURE_BUFFERS = 10       # 프레임 링 슬롯 수 (쓰는 중 + 슬롯 3개/추론/화면/팬이 잡고 있는 프레임보다 넉넉히)
+FRAME_RING_NAME = 'smart_fan_frames'  # 프레임 링 공유 메모리 이름 (/dev/shm, 다른 프로세스가 붙어서 읽음)
+FRAME_RING_LOCK = '/tmp/smart_fan_frames.lock'  # 링을 만든 인스턴스가 잡는 잠금 (두 번째 인스턴스는 시작하지 않음)
+DISPLAY_WIDTH = 640        # 화면/미리보기 크기
+DISPLAY_HEIGHT = 480
+apply_config()
+
+
+class ReplayCapture:
+    """동영상 파일/이미지 폴더를 cv2.VideoCapture처럼 읽는다 (벤치마크 재생용).
+
+    lockstep이면 frame_consumed 이벤트(추론이 프레임을 가져감)를 기다렸다가 다음 프레임을 준다.
+    paced=False면 대기 없이 바로 다음 프레임 (카메라 여러 대 재생에서 첫 번째가 속도를 맞춤).
+    """
+
+    def __init__(self, path, fps=0, lockstep=False, paced=True):
+        self.video = None
+        self.paths = []
+        source_fps = 30.0
+        if os.path.isdir(path):
+            self.paths = sorted(p for ext in ('*.jpg', '*.jpeg', '*.png') for p in glob.glob(os.path.join(path, ext)))
+        else:
+            self.video = cv2.VideoCapture(path)
+            source_fps = self.video.get(cv2.CAP_PROP_FPS) or source_fps
+        self.period = 1.0 / (fps or source_fps)
+        self.lockstep = lockstep
+        self.paced = paced
+        self.index = 0
+        self.frames_read = 0
+        self.next_time = None
+        self.image = None
+
+    def isOpened(self):
+        return self.video.isOpened() if self.video is not None else bool(self.paths)
+
+    def set(self, prop, value):
+        return True
+
+    def get(self, prop):
+        return 0  # 설정한 FRAME_WIDTH/HEIGHT 그대로 사용
+
+    def grab(self):
+        if self.paced and self.lockstep:
+            while not frame_consumed.wait(0.1):
+                if stop_event.is_set():
+                    return False
+            frame_consumed.clear()
+        elif self.paced:
+            now = time.monotonic()
+            if self.next_time is not None and self.next_time > now:
+                time.sleep(self.next_time - now)
+            self.next_time = max(now, self.next_time or now) + self.period
+
+        if self.video is not None:
+            ok, self.image = self.video.read()
+        else:
+            ok = self.index < len(self.paths)
+            self.image = cv2.imread(self.paths[self.index]) if ok else None
+            self.index += 1
+        if not ok or self.image is None:
+            self.image = None
+            return False
+        self.frames_read += 1
+        return True
+
+    def retrieve(self, dst=None):
+        if self.image is None:
+            return False, None
+        if dst is None:
+            return True, cv2.resize(self.image, (CAMERA_WIDTH, CAMERA_HEIGHT))
+        cv2.resize(self.image, (dst.shape[1], dst.shape[0]), dst=dst)
+        return True, dst
+
+    def read(self, dst=None):
+        return self.retrieve(dst) if self.grab() else (False, None)
+
+    def release(self):
+        if self.video is not None:
+            self.video.release()
+
+
+def open_camera(index, camera):
+    if BENCHMARK:
+        capture = ReplayCapture(args.replay[index], args.replay_fps, args.lockstep, paced=(index == 0))
+    else:
+        capture = cv2.VideoCapture(camera['device'], cv2.CAP_V4L2)
+    capture.set(cv2.CAP_PROP_FOURCC, cv2.VideoWriter_fourcc(*CAPTURE_FOURCC))
+    capture.set(cv2.CAP_PROP_FRAME_WIDTH, FRAME_WIDTH)
+    capture.set(cv2.CAP_PROP_FRAME_HEIGHT, FRAME_HEIGHT)
+    capture.set(cv2.CAP_PROP_BUFFERSIZE, 1)  # 드라이버 큐에 오래된 프레임이 쌓이지 않게
+    if not capture.isOpened():
+        print(f"오류: 카메라를 열 수 없습니다. (장치 {camera['device']})")
+        exit()
+    return capture
+
+
+if BENCHMARK and len(args.replay) != len(CAMERAS):
+    print(f"오류: 재생 소스 {len(args.replay)}개, 카메라 {len(CAMERAS)}대 (CAMERAS 수만큼 지정)")
     exit()
+caps = [open_camera(index, camera) for index, camera in enumerate(CAMERAS)]
+# 드라이버가 가까운 해상도로 바꿨을 수 있으므로 실제 값 사용 (카메라 1대분)
+CAMERA_WIDTH = int(caps[0].get(cv2.CAP_PROP_FRAME_WIDTH)) or FRAME_WIDTH
+CAMERA_HEIGHT = int(caps[0].get(cv2.CAP_PROP_FRAME_HEIGHT)) or FRAME_HEIGHT
+print(f"✓ 카메라 {len(caps)}대: {CAMERA_WIDTH}x{CAMERA_HEIGHT} {CAPTURE_FOURCC}" if not BENCHMARK
+      else f"✓ 재생: {', '.join(args.replay)} -> {CAMERA_WIDTH}x{CAMERA_HEIGHT}{' (lockstep)' if args.lockstep else ''}")
+
+# 파이프라인이 보는 프레임 (FRAME_WIDTH가 VIEW_HFOV만큼의 각도를 덮음, 가운데 = 팬 정면)
+# 카메라 여러 대면 첫 카메라의 도/픽셀로 만든 파노라마 캔버스에 카메라 영상을 yaw 위치에 붙인다
+if MULTI_CAMERA:
+    degrees_per_pixel = CAMERAS[0]['hfov'] / CAMERA_WIDTH
+    half_angle = max(abs(camera['yaw']) + camera['hfov'] / 2 for camera in CAMERAS)
+    FRAME_WIDTH = int(round(2 * half_angle / degrees_per_pixel))
+    FRAME_HEIGHT = CAMERA_HEIGHT
+    VIEW_HFOV = FRAME_WIDTH * degrees_per_pixel
+    camera_tiles = []  # 카메라별 캔버스 위치 (left, width)
+    for camera in CAMERAS:
+        tile_width = int(round(camera['hfov'] / degrees_per_pixel))
+        tile_left = int(round((camera['yaw'] - camera['hfov'] / 2 + half_angle) / degrees_per_pixel))
+        tile_left = min(max(tile_left, 0), FRAME_WIDTH - tile_width)
+        camera_tiles.append((tile_left, tile_width))
+    print(f"✓ 파노라마: {FRAME_WIDTH}x{FRAME_HEIGHT} ({VIEW_HFOV:.0f}도), 카메라 위치 {camera_tiles}")
+else:
+    FRAME_WIDTH, FRAME_HEIGHT = CAMERA_WIDTH, CAMERA_HEIGHT
+    VIEW_HFOV = CAMERAS[0]['hfov']
+    camera_tiles = [(0, CAMERA_WIDTH)]
+
+
+class FrameRef:
+    """링 슬롯 하나에 쓰인 특정 프레임 (seq). acquire()가 성공한 만큼 release() 해야 한다."""
+
+    __slots__ = ('ring', 'index', 'seq')
+
+    def __init__(self, ring, index, seq):
+        self.ring = ring
+        self.index = index
+        self.seq = seq
+
+    def acquire(self):
+        """참조를 하나 잡는다. 그 사이 슬롯이 다른 프레임으로 바뀌었으면 False"""
+        return self.ring.acquire(self.index, self.seq)
+
+    def release(self):
+        self.ring.release(self.index)
+
+
+class FrameRing:
+    """미리 할당한 공유 메모리 프레임 슬롯 (캡처가 한 번 쓰고, 소비자는 복사 없이 슬롯을 직접 읽음).
+
+    슬롯 = 카메라별 프레임 (+ 여러 대면 파노라마 캔버스), 슬롯마다 시퀀스 번호와 참조 수.
+    캡처는 참조 수 0인 슬롯 중 가장 오래된 것에만 쓰고, 이 프로세스의 소비자는 참조를 잡은 동안만 읽는다.
+    LatestSlot은 담고 있는 항목의 참조를 하나 잡아 두므로 슬롯에 남아 있는 프레임은 덮어써지지 않는다.
+
+    공유 메모리 배치 (다른 프로세스용, FrameRing.attach):
+      [0] HEADER ('SFRM', 슬롯 수, 카메라 수, 카메라 높이/너비, 캔버스 높이/너비)
+      [meta_offset] 슬롯마다 META (seq: 0 = 쓰는 중, timestamp, refs)
+      [data_offset] 슬롯마다 카메라 프레임들 + 캔버스 (uint8 HxWx3)
+    다른 프로세스는 참조를 잡을 수 없으므로 읽기 전후로 seq가 그대로인지 확인한다 (seqlock).
+    """
+
+    HEADER = struct.Struct('<4sIIIIII')
+    META = np.dtype([('seq', '<u8'), ('timestamp', '<f8'), ('refs', '<i4'), ('pad', '<i4')])
+    ALIGN = 64
+
+    def __init__(self, name, slots, cameras, camera_shape, frame_shape, create=True, lock_path=FRAME_RING_LOCK):
+        camera_bytes = camera_shape[0] * camera_shape[1] * 3
+        canvas_bytes = frame_shape[0] * frame_shape[1] * 3 if cameras > 1 else 0
+        meta_offset = self._aligned(self.HEADER.size)
+        data_offset = self._aligned(meta_offset + self.META.itemsize * slots)
+        slot_bytes = self._aligned(camera_bytes * cameras + canvas_bytes)
+
+        self.lock = None
+        if create:
+            self.lock = self._lock_owner(name, lock_path)
+            size = data_offset + slot_bytes * slots
+            try:
+                self.shm = shared_memory.SharedMemory(name=name, create=True, size=size)
+            except FileExistsError:
+                # 잠금을 잡았으므로 살아 있는 인스턴스의 링은 아님 = 이전 실행이 비정상 종료하며 남긴 링
+                stale = shared_memory.SharedMemory(name=name)
+                stale.close()
+                stale.unlink()
+                self.shm = shared_memory.SharedMemory(name=name, create=True, size=size)
+            self.HEADER.pack_into(self.shm.buf, 0, b'SFRM', slots, cameras, *camera_shape[:2], *frame_shape[:2])
+        else:
+            self.shm = shared_memory.SharedMemory(name=name)
+
+        self.meta = np.ndarray((slots,), dtype=self.META, buffer=self.shm.buf, offset=meta_offset)
+        self.slots = []  # (파이프라인 프레임, [카메라별 프레임])
+        for index in range(slots):
+            base = data_offset + index * slot_bytes
+            frames = [np.ndarray((camera_shape[0], camera_shape[1], 3), dtype=np.uint8, buffer=self.shm.buf,
+                                 offset=base + camera * camera_bytes) for camera in range(cameras)]
+            frame = frames[0] if cameras == 1 else \
+                np.ndarray((frame_shape[0], frame_shape[1], 3), dtype=np.uint8, buffer=self.shm.buf,
+                           offset=base + cameras * camera_bytes)
+            self.slots.append((frame, frames))
+
+        self.cond = threading.Condition()
+        self.seqs = [0] * slots   # 이 프로세스 기준 (meta seq와 같음)
+        self.refs = [0] * slots
+        self.next_seq = 1
+        if create:
+            self.meta['seq'] = 0
+            self.meta['refs'] = 0
+
+    @staticmethod
+    def _lock_owner(name, lock_path):
+        """링을 만드는 쪽의 잠금 (프로세스가 죽으면 커널이 풀어 주므로 남은 잠금 파일은 상관없음)"""
+        lock = open(lock_path, 'a')
+        try:
+            fcntl.flock(lock, fcntl.LOCK_EX | fcntl.LOCK_NB)
+        except BlockingIOError:
+            lock.close()
+            raise SystemExit(f"오류: 다른 인스턴스가 프레임 링({name})을 쓰는 중입니다 (잠금 {lock_path})")
+        return lock
+
+    def _aligned(self, offset):
+        return (offset + self.ALIGN - 1) // self.ALIGN * self.ALIGN
+
+    @classmethod
+    def attach(cls, name=FRAME_RING_NAME):
+        """다른 프로세스에서 읽기용으로 붙는다 (latest()로 읽고 seq가 그대로인지 다시 확인)"""
+        shm = shared_memory.SharedMemory(name=name)
+        magic, slots, cameras, camera_height, camera_width, frame_height, frame_width = cls.HEADER.unpack_from(shm.buf)
+        shm.close()
+        if magic != b'SFRM':
+            raise ValueError(f"프레임 링이 아님: {name}")
+        return cls(name, slots, cameras, (camera_height, camera_width), (frame_height, frame_width), create=False)
+
+    def latest(self):
+        """(index, seq, timestamp) 가장 최근에 다 쓴 슬롯 (없으면 None)"""
+        index = int(np.argmax(self.meta['seq']))
+        seq = int(self.meta['seq'][index])
+        return (index, seq, float(self.meta['timestamp'][index])) if seq else None
+
+    def acquire_write(self, timeout):
+        """참조가 없는 가장 오래된 슬롯을 캡처용으로 잡는다 (timeout까지 없으면 None)"""
+        with self.cond:
+            if not self.cond.wait_for(lambda: 0 in self.refs, timeout):
+                return None
+            index = min((i for i, refs in enumerate(self.refs) if refs == 0), key=lambda i: self.seqs[i])
+            self.refs[index] = 1
+            self.seqs[index] = 0
+            self.meta['seq'][index] = 0  # 쓰는 중 (다른 프로세스는 건너뜀)
+            self.meta['refs'][index] = 1
+        return index
+
+    def publish(self, index, timestamp):
+        """다 쓴 슬롯에 시퀀스를 붙인다. 캡처의 참조를 담은 FrameRef 반환 (넘겨준 뒤 release)"""
+        with self.cond:
+            seq = self.next_seq
+            self.next_seq += 1
+            self.seqs[index] = seq
+            self.meta['timestamp'][index] = timestamp
+            self.meta['seq'][index] = seq
+        return FrameRef(self, index, seq)
+
+    def abort_write(self, index):
+        """읽기에 실패한 슬롯을 시퀀스 없이 돌려놓는다"""
+        self.release(index)
+
+    def acquire(self, index, seq):
+        with self.cond:
+            if self.seqs[index] != seq:
+                return False
+            self.refs[index] += 1
+            self.meta['refs'][index] = self.refs[index]
+            return True
+
+    def release(self, index):
+        with self.cond:
+            self.refs[index] -= 1
+            self.meta['refs'][index] = self.refs[index]
+            if self.refs[index] == 0:
+                self.cond.notify_all()
+
+    def close(self, unlink=False):
+        """numpy 뷰를 놓고 공유 메모리를 닫는다 (뷰가 남아 있으면 SharedMemory.close가 BufferError).
+        unlink: 만든 쪽이 종료할 때 링을 지우고 잠금을 푼다 (close 다음에 해야 함)"""
+        self.meta = None
+        self.slots = []
+        try:
+            self.shm.close()
+        except BufferError:
+            # 제때 끝나지 않은 스레드가 아직 프레임을 잡고 있음 (지우기는 그대로 진행)
+            print("⚠ 프레임 링: 아직 사용 중인 프레임이 있어 닫지 못함")
+        if unlink:
+            self.shm.unlink()
+        if self.lock is not None:
+            self.lock.close()
+            self.lock = None
+
+
+# 캡처 프레임은 링에 한 번만 쓰고, 추론/제어/화면은 참조만 주고받음 (프레임마다 힙 할당/복사 없음)
+frame_ring = FrameRing(FRAME_RING_NAME, CAPTURE_BUFFERS, len(CAMERAS),
+                       (CAMERA_HEIGHT, CAMERA_WIDTH), (FRAME_HEIGHT, FRAME_WIDTH))
+blob_buffers = {size: (np.empty((size, size, 3), dtype=np.uint8),
+                       np.empty((len(CAMERAS), 3, size, size), dtype=np.float32))
+                for size in {input_size, search_input_size} if size}  # 추론 입력 크기 -> (resize, blob)
 
 # ------------------- 제어 설정 -------------------
 confidence_threshold = 0.5
-input_size = 160
+nms_threshold = 0.45
+PERSON_CLASS_ID = class_names.index('person')
+PERSON_ONLY_DECODE = True  # True: person 점수 열만 사용 (80개 클래스 argmax 생략)
 MIN_ANGLE = 10
 MAX_ANGLE = 170
 CENTER_ANGLE = 90
 
-# SPI 명령/상태 코드
-RESET_COMMAND = 200
-START_COMMAND = 255
-POLL_COMMAND = 0
+# SPI 상태 코드
 STATUS_RUNNING = 222
 STATUS_READY = 111
 STATUS_HOMING_OFF = 0
 
+# SPI 프레임 프로토콜 (ATmega128_fan.c와 동일하게 유지)
+SPI_FRAME_LEN = 12
+SPI_CMD_HEADER = 0xA5
+SPI_STATUS_HEADER = 0x5A
+OP_POLL = 0x00
+OP_START = 0x01
+OP_RESET = 0x02
+OP_TRACK = 0x03
+OP_SET_OCR = 0x04
+OP_SET_FAN_RAMP = 0x05
+OP_SET_PARAM = 0x06          # speed 바이트 = 설정 번호, 값 = 설정값 (RAM에만 적용)
+OP_GET_PARAM = 0x07          # speed 바이트 = 설정 번호, 다음 상태 프레임 echo = 설정값 (SPEED_FLAG_PARAM)
+OP_SAVE_PARAMS = 0x08        # EEPROM에 저장 (값 1 = 기본값으로 되돌린 뒤 저장)
+FIRMWARE_PARAM_IDS = {       # ATmega128_fan.c PARAM_* 번호
+    'slew_max_step': 0, 'slew_accel': 1, 'angle10_min': 2, 'angle10_max': 3,
+    'duty_weakest': 4, 'duty_strongest': 5, 'fan_ramp_ms': 6,
+}
+# ATmega128_fan.c #define 값 (모의 펌웨어의 기본값/범위 검사용, 펌웨어를 바꾸면 같이 바꿀 것)
+FIRMWARE_ICR_8KHZ = 1999                                      # ICR_8KHZ (팬 PWM TOP)
+FIRMWARE_FAN_OCR_STRONGEST = int(FIRMWARE_ICR_8KHZ * 0.1)     # FAN_OCR_STRONGEST
+FIRMWARE_FAN_OCR_WEAKEST = int(FIRMWARE_ICR_8KHZ * 0.7)       # FAN_OCR_WEAKEST
+FIRMWARE_ANGLE10_MIN = 100                                    # SERVO_ANGLE10_MIN
+FIRMWARE_ANGLE10_CENTER = 900                                 # SERVO_ANGLE10_CENTER
+FIRMWARE_ANGLE10_MAX = 1700                                   # SERVO_ANGLE10_MAX
+FIRMWARE_FAN_RAMP_MAX = 10000                                 # FAN_RAMP_TIME_MAX
+FIRMWARE_PARAM_DEFAULTS = {  # params_defaults()
+    'slew_max_step': 24,                                      # SERVO_SLEW_MAX_STEP / SERVO_OCR_SCALE
+    'slew_accel': 4,                                          # SERVO_SLEW_ACCEL / SERVO_OCR_SCALE
+    'angle10_min': FIRMWARE_ANGLE10_MIN,
+    'angle10_max': FIRMWARE_ANGLE10_MAX,
+    'duty_weakest': int(FIRMWARE_ICR_8KHZ * 0.6),             # DUTY_HIGH
+    'duty_strongest': int(FIRMWARE_ICR_8KHZ * 0.2),           # DUTY_LOW
+    'fan_ramp_ms': 1500,                                      # FAN_RAMP_TIME_MS
+}
+SPEED_KEEP = 0xFF
+SPEED_POWER_FLAG = 0x80      # speed 바이트 = SPEED_POWER_FLAG | 팬 세기(0~100%)
+SPEED_FLAG_STALL = 0x80      # 상태 프레임 speed 바이트: 팬 정지(회전 없음) 감지
+SPEED_FLAG_PARAM = 0x40      # 상태 프레임 speed 바이트: echo가 각도 명령 stamp가 아니라 OP_GET_PARAM 값
+SLEW_KEEP = 0
+ACK_OK = 0
+ACK_NAMES = {0: 'OK', 1: 'CRC_ERROR', 2: 'REJECTED', 3: 'BAD_OPCODE'}
+
 # 제어 파라미터
-DEAD_ZONE_PERCENT = 0.275
+CONTROL_MODE = 'pd'        # 'pd': FOV 기반 절대 각도 (ATmega 슬루 사용), 'step': MOVE_SPEED씩 이동
+DEAD_ZONE_PERCENT = 0.275  # step 모드 데드존
 MOVE_SPEED = 3
 RESET_TIMEOUT = 5.0
 
+# PD 제어 파라미터
+PD_KP = 0.9                # 예측 오차 중 한 번에 보정할 비율
+PD_KD = 0.05               # 대상 각속도 항 (초)
+PD_LATENCY = 0.08          # 캡처 이후 명령 적용까지의 추가 지연 보상 (초)
+PD_DEAD_BAND = 1.5         # 이 각도 이내 오차는 무시 (도)
+PD_SLEW_STEP = 0           # 각도 명령마다 보낼 슬루 상한 (기존 4us OCR 카운트/프레임, 0 = ATmega 설정 slew_max_step)
+                           # ATmega는 설정 slew_max_step보다 큰 값은 설정값으로 낮춘다
+STATUS_POLL_INTERVAL = 0.1 # 각도 변화가 없을 때 상태 확인 간격 (초)
+
+# 거리(박스 면적) 기반 팬 세기: 각도와 같은 OP_TRACK 프레임으로 전송, ATmega 램프로 적용
+# 켜두면 PD0 버튼으로 바꾼 속도는 다음 세기 변경 때 덮어씀
+FAN_AREA_MODE = True
+FAN_AREA_NEAR = 0.25       # 프레임 대비 박스 면적 비율이 이 이상이면 가까움 -> FAN_POWER_NEAR
+FAN_AREA_FAR = 0.02        # 이 이하이면 멂 -> FAN_POWER_FAR
+FAN_POWER_NEAR = 20        # 가까울 때 팬 세기 (%)
+FAN_POWER_FAR = 100        # 멀 때 팬 세기 (%)
+FAN_AREA_SMOOTHING = 0.2   # 면적 지수 평활 계수 (박스 크기 흔들림 완화)
+FAN_POWER_MIN_CHANGE = 5   # 이만큼 이상 바뀔 때만 전송 (%)
+
+# 파이프라인 설정
+CONTROL_HZ = 30            # 제어/SPI 스레드 주기
+MAX_FRAME_AGE = 0.3        # 서보 명령에 쓸 수 있는 프레임의 최대 나이 (초)
+WAIT_POLL_INTERVAL = 0.3   # WAITING_BUTTON 상태 폴링/알림 대기 간격 (초)
+STOP_POLL_INTERVAL = 0.5   # STOPPED 상태 폴링/알림 대기 간격 (초)
+
+# ROI 추론 설정 (TRACKING 중 마지막 박스 주변만 잘라서 추론)
+ROI_ENABLED = True
+ROI_EXPAND = 2.0           # 마지막 박스 대비 ROI 한 변 배수 (정사각형)
+ROI_FULL_REFRESH = 10      # ROI 모드에서도 N 프레임마다 전체 프레임 탐지
+ROI_MIN_CONFIDENCE = 0.6   # 추적 대상 신뢰도가 이보다 낮으면 전체 프레임 탐지
+
+# 탐지 사이 추적 설정 (광류 + 칼만 필터)
+TRACKER_ENABLED = True
+TRACKER_DETECT_INTERVAL = 3   # 추적 중에는 K 프레임마다 한 번만 탐지기 실행
+TRACKER_MAX_POINTS = 40       # 박스 안 특징점 수
+TRACKER_MIN_POINTS = 8        # 이보다 적게 남으면 추적 실패 -> 탐지
+TRACK_COAST_TIME = 0.7        # 탐지가 끊겨도 칼만 예측으로 추적을 유지하는 시간 (초)
+KALMAN_PROCESS_NOISE = 2000.0     # 가속도 잡음 (px^2/s^3)
+KALMAN_MEASUREMENT_NOISE = 25.0   # center_x 측정 잡음 (px^2)
+
+# 여러 사람 ID 유지 + 대상 선택
+ASSOC_IOU_MIN = 0.3           # 이 이상 겹치면 같은 사람
+ASSOC_MAX_DISTANCE = 0.15     # 안 겹쳐도 center_x 차이가 프레임 폭의 이 비율 이내면 같은 사람
+ASSOC_MAX_AGE = 1.0           # 이 시간 동안 안 보이면 ID 폐기 (초)
+TARGET_POLICY = 'sticky'      # 'sticky': 현재 대상 유지, 'largest': 매번 가장 큰 사람,
+                              # 'sweep': 사람들을 번갈아 조준, 'centroid': 전체 중심 조준
+TARGET_SWITCH_RATIO = 1.5     # sticky: 다른 사람이 이 배수 이상 커야 대상 교체
+TARGET_SWEEP_DWELL = 4.0      # sweep: 한 사람에 머무는 시간 (초)
+
+# 재탐색 (SEARCHING: 마지막 위치/각속도로 예측한 각도로 바로 이동 -> 작은 입력으로 빠른 스캔)
+# False면 기존처럼 last_direction으로 MOVE_SPEED씩 끝까지 이동
+PREDICTIVE_SEARCH = True
+SEARCH_LEAD_MAX = 1.0         # 예측에 쓰는 최대 경과 시간 (초, 가림 유지 TRACK_COAST_TIME 포함)
+SEARCH_MIN_RATE = 5.0         # 이보다 느리면 각속도 대신 last_direction으로 스캔 방향 결정 (도/초)
+SEARCH_SETTLE_FRAMES = 2      # 예측 각도 도착 후 스캔 전에 탐지해 보는 프레임 수
+SEARCH_SCAN_STEP = 10         # 스캔 중 탐지 1회당 이동 각도 (도, 화각보다 충분히 작게)
+
+# 움직임 게이트 (모든 상태): 축소 그레이스케일 차이로 마지막 결과 이후 장면이 그대로면
+# 탐지기/광류를 건너뛰고 마지막 결과를 재사용 (팬 머리의 카메라가 도는 중에는 항상 탐지)
+MOTION_GATE = True
+MOTION_REUSE_MAX_AGE = 0.5    # 변화가 없어도 이 시간이 지나면 다시 탐지 (초)
+CAMERA_STILL_TOLERANCE = 0.5  # 보고된 서보 각도가 명령 각도와 이 이내면 카메라 정지로 봄 (도)
+
+# 저전력 대기 (작동 중인 팬이 모두 IDLE/WAITING = 아무도 없음: 탐지기를 낮은 주기로만 실행)
+# 그 사이 프레임은 움직임만 보고, 움직이면 그 프레임에서 바로 탐지
+IDLE_DUTY_CYCLE = True
+IDLE_STATES = ('IDLE', 'WAITING')
+IDLE_INFERENCE_HZ = 1.0       # 움직임이 없어도 탐지하는 주기 (Hz, 가만히 있는 사람 대비)
+MOTION_WIDTH = 80             # 움직임 검사용 축소 크기
+MOTION_HEIGHT = 60
+MOTION_PIXEL_THRESHOLD = 25   # 밝기 차이가 이 이상인 픽셀을 변화로 셈 (0~255)
+MOTION_AREA_RATIO = 0.01      # 변화 픽셀 비율이 이 이상이면 움직임
+
+# 실행 중 설정 변경 (로컬 제어 소켓, 명령 형식은 ControlHandler 참고)
+# LIVE_CONFIG_KEYS만 바로 반영되고, 나머지(모델/입력 크기/카메라/팬 목록 등)는 설정 파일을 고친 뒤 재시작
+CONTROL_SOCKET_PATH = '/tmp/smart_fan.sock'  # ''이면 제어 소켓 없음
+FIRMWARE_REQUEST_TIMEOUT = 3.0  # ATmega 설정 요청 응답 대기 (초, SPI는 각 팬의 제어 스레드가 처리)
+LIVE_CONFIG_KEYS = (
+    'confidence_threshold', 'nms_threshold', 'MIN_ANGLE', 'MAX_ANGLE',
+    'DEAD_ZONE_PERCENT', 'MOVE_SPEED', 'RESET_TIMEOUT',
+    'PD_KP', 'PD_KD', 'PD_LATENCY', 'PD_DEAD_BAND', 'PD_SLEW_STEP', 'STATUS_POLL_INTERVAL',
+    'FAN_AREA_MODE', 'FAN_AREA_NEAR', 'FAN_AREA_FAR', 'FAN_POWER_NEAR', 'FAN_POWER_FAR',
+    'FAN_AREA_SMOOTHING', 'FAN_POWER_MIN_CHANGE', 'MAX_FRAME_AGE',
+    'ROI_EXPAND', 'ROI_FULL_REFRESH', 'ROI_MIN_CONFIDENCE', 'TRACKER_DETECT_INTERVAL', 'TRACK_COAST_TIME',
+    'ASSOC_IOU_MIN', 'ASSOC_MAX_DISTANCE', 'ASSOC_MAX_AGE', 'TARGET_SWITCH_RATIO', 'TARGET_SWEEP_DWELL',
+    'SEARCH_LEAD_MAX', 'SEARCH_MIN_RATE', 'SEARCH_SETTLE_FRAMES', 'SEARCH_SCAN_STEP',
+    'MOTION_REUSE_MAX_AGE', 'CAMERA_STILL_TOLERANCE', 'IDLE_INFERENCE_HZ',
+    'MOTION_PIXEL_THRESHOLD', 'MOTION_AREA_RATIO',
+)
+
+# 지연 측정 (단계별 롤링 샘플 -> p50/p99, 파일과 미리보기 서버 /metrics 로 내보냄)
+LATENCY_WINDOW = 512                  # 단계별로 보관하는 최근 샘플 수
+LATENCY_BUCKETS_MS = (1, 2, 5, 10, 20, 50, 100, 200, 500)
+LATENCY_EXPORT_PATH = '/tmp/smart_fan_latency.json'  # ''이면 파일로 내보내지 않음
+LATENCY_EXPORT_INTERVAL = 5.0         # 초
+
+# 화면 설정
+HEADLESS = False           # True: 모니터 없이 실행 (오버레이 그리기/창 표시 안 함)
+PREVIEW_PORT = 0           # 0이 아니면 http://<라즈베리파이>:PORT/ 로 MJPEG 미리보기
+PREVIEW_FPS = 2
+PREVIEW_JPEG_QUALITY = 70
+apply_config(final=True)
+if BENCHMARK:
+    HEADLESS = True
+
 # ------------------- 상태 변수 -------------------
-current_state = 'WAITING_BUTTON'  # 초기: 버튼 대기
-current_angle = CENTER_ANGLE 
-last_direction = 'none' 
-wait_start_time = 0
+# 팬별 상태 머신 변수는 FanController에 있음
+roi_target = None   # 제어 -> 추론: 추적 중인 박스, 신뢰도, ID (없으면 전체 프레임, 팬 1대일 때만)
+search_scan = False  # 제어 -> 추론: 재탐색 스캔 중 (search_input_size로 탐지, 팬 1대일 때만)
+reused_results = 0   # 움직임 게이트로 탐지 없이 재발행한 결과 수 (벤치마크 보고용)
+inference_users = set()  # 작동 중인 팬 이름 (하나라도 있으면 추론)
+inference_users_lock = threading.Lock()
 
-# FPS 계산
-frame_count = 0
-start_time = time.time()
-last_frame = None
+# ------------------- 파이프라인 -------------------
+class LatestSlot:
+    """최신 값 하나만 보관하는 단일 슬롯 큐 (새 값이 들어오면 이전 값은 버린다)
 
-try:
-    print("\n" + "=" * 60)
-    print("  스마트 팬 제어 시스템 시작")
-    print("=" * 60)
-    print("  • PD1 버튼을 눌러 시스템을 시작하세요")
-    print("  • 종료: 'q' 키")
-    print("=" * 60 + "\n")
-    
-    while True:
+    항목에 'ref'(FrameRef)가 있으면 담고 있는 동안 그 프레임의 참조를 잡는다.
+    꺼낸 쪽은 쓰기 전에 item['ref'].acquire()로 자기 참조를 잡아야 한다 (실패 = 이미 덮어써진 프레임).
+    """
 
-        
-        
-        # ========== [상태 1] 버튼 대기 (초기 시작) ==========
-        if current_state == 'WAITING_BUTTON':
-            ret, frame = cap.read()
-            if not ret:
+    def __init__(self):
+        self._cond = threading.Condition()
+        self._item = None
+        self._version = 0
+
+    def put(self, item):
+        """이미 덮어써진 프레임이면 넣지 않고 False"""
+        ref = item.get('ref') if isinstance(item, dict) else None
+        if ref is not None and not ref.acquire():
+            return False
+        with self._cond:
+            previous = self._item
+            self._item = item
+            self._version += 1
+            self._cond.notify_all()
+        if isinstance(previous, dict) and previous.get('ref') is not None:
+            previous['ref'].release()
+        return True
+
+    def peek(self):
+        with self._cond:
+            return self._version, self._item
+
+    def get_newer(self, version, timeout=None):
+        """version 보다 새로운 값을 기다린다. 시간 초과 시 (version, None)."""
+        with self._cond:
+            self._cond.wait_for(lambda: self._version > version, timeout)
+            if self._version <= version:
+                return version, None
+            return self._version, self._item
+
+    def clear(self):
+        """담고 있던 항목(과 그 참조)을 놓는다 (종료 시 링을 닫기 전에)"""
+        with self._cond:
+            previous = self._item
+            self._item = None
+        if isinstance(previous, dict) and previous.get('ref') is not None:
+            previous['ref'].release()
+
+
+class LatencyStats:
+    """단계별 최근 소요 시간(초) 롤링 버퍼. 여러 스레드에서 record 해도 된다."""
+
+    STAGES = ('capture', 'motion', 'blob', 'forward', 'decode', 'flow', 'spi', 'render',
+              'frame_age', 'photon_to_command')
+
+    def __init__(self, window=LATENCY_WINDOW):
+        self._lock = threading.Lock()
+        self._samples = {stage: deque(maxlen=window) for stage in self.STAGES}
+        self._totals = {stage: 0 for stage in self.STAGES}
+
+    def record(self, stage, seconds):
+        with self._lock:
+            self._samples[stage].append(seconds)
+            self._totals[stage] += 1
+
+    def snapshot(self):
+        """단계별 {'count'(창 안), 'total'(누적), 'p50', 'p99', 'max', 'histogram'} (ms)"""
+        with self._lock:
+            copies = {stage: sorted(values) for stage, values in self._samples.items() if values}
+            totals = dict(self._totals)
+        summary = {}
+        for stage, values in copies.items():
+            count = len(values)
+            histogram = {f"<={bound}": 0 for bound in LATENCY_BUCKETS_MS}
+            histogram['>'] = 0
+            for value in values:
+                ms = value * 1000
+                bucket = next((f"<={bound}" for bound in LATENCY_BUCKETS_MS if ms <= bound), '>')
+                histogram[bucket] += 1
+            summary[stage] = {
+                'count': count,
+                'total': totals[stage],
+                'p50': round(values[count // 2] * 1000, 2),
+                'p99': round(values[min(count - 1, int(count * 0.99))] * 1000, 2),
+                'max': round(values[-1] * 1000, 2),
+                'histogram': histogram,
+            }
+        return summary
+
+
+latency = LatencyStats()
+inference_enabled = threading.Event()  # 작동 중일 때만 추론
+frame_consumed = threading.Event()  # 추론이 프레임을 가져감 (재생 lockstep용)
+frame_consumed.set()                # 첫 프레임은 바로 공급
+frame_slot = LatestSlot()       # 캡처 -> 추론
+detection_slot = LatestSlot()   # 추론 -> 제어
+view_slot = LatestSlot()        # 제어 -> 화면 표시
+
+
+# ------------------- SPI 프레임 -------------------
+def crc8(data):
+    """CRC-8 (다항식 0x07, 초기값 0x00)"""
+    crc = 0
+    for byte in data:
+        crc ^= byte
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x07) & 0xFF if crc & 0x80 else (crc << 1) & 0xFF
+    return crc
+
+
+class StatusLine:
+    """ATmega 상태 변경 알림 핀. 핀을 쓸 수 없으면 wait()가 단순 sleep(폴링)이 된다."""
+
+    def __init__(self, pin, enabled=True):
+        self.gpio = None
+        self.pin = pin
+        if not enabled:
+            return
+        try:
+            import RPi.GPIO as GPIO
+            GPIO.setmode(GPIO.BCM)
+            GPIO.setup(pin, GPIO.IN, pull_up_down=GPIO.PUD_DOWN)
+            self.gpio = GPIO
+            print(f"✓ 상태 알림 핀 사용: GPIO{pin}")
+        except (ImportError, RuntimeError) as e:
+            print(f"⚠ 상태 알림 핀 사용 불가, 폴링으로 동작: {e}")
+
+    def is_set(self):
+        return self.gpio is not None and self.gpio.input(self.pin) == self.gpio.HIGH
+
+    def wait(self, timeout):
+        """상태가 바뀌었을 수 있으면 True. 핀이 없으면 timeout 동안 잠든 뒤 True."""
+        if self.gpio is None:
+            time.sleep(timeout)
+            return True
+        if self.is_set():
+            return True
+        return self.gpio.wait_for_edge(self.pin, self.gpio.RISING, timeout=int(timeout * 1000)) is not None
+
+    def close(self):
+        if self.gpio is not None:
+            self.gpio.cleanup(self.pin)
+
+
+class SpiIocTransfer(ctypes.Structure):
+    """linux/spi/spidev.h struct spi_ioc_transfer"""
+    _fields_ = [('tx_buf', ctypes.c_uint64), ('rx_buf', ctypes.c_uint64), ('len', ctypes.c_uint32),
+                ('speed_hz', ctypes.c_uint32), ('delay_usecs', ctypes.c_uint16), ('bits_per_word', ctypes.c_uint8),
+                ('cs_change', ctypes.c_uint8), ('tx_nbits', ctypes.c_uint8), ('rx_nbits', ctypes.c_uint8),
+                ('word_delay_usecs', ctypes.c_uint8), ('pad', ctypes.c_uint8)]
+
+
+class SpacedSpiDev:
+    """spidev 장치에 바이트 사이 간격을 두고 버스트를 보낸다 (CS는 버스트 내내 LOW).
+
+    py-spidev의 xfer(data, speed_hz, delay_usecs)는 전송 1개로 보내므로 delay_usecs가 마지막 바이트 뒤에
+    한 번만 들어가고 바이트는 붙어서 나간다. 그래서 1바이트 전송 len(data)개를 SPI_IOC_MESSAGE 하나로 묶고
+    (cs_change=0), 마지막을 뺀 전송마다 delay_usecs를 준다. 버퍼는 프레임 길이만큼 미리 만들어 재사용한다.
+    """
+
+    IOC_MESSAGE_BASE = 0x40006B00  # _IOW('k', 0, char[]) (크기는 16번 비트부터)
+
+    def __init__(self, bus, device, speed_hz, length=SPI_FRAME_LEN):
+        self.spi = spidev.SpiDev()
+        self.spi.open(bus, device)
+        self.spi.max_speed_hz = speed_hz
+        self.spi.mode = 0
+        self.length = length
+        self.tx = (ctypes.c_uint8 * length)()
+        self.rx = (ctypes.c_uint8 * length)()
+        self.transfers = (SpiIocTransfer * length)()
+        for index, transfer in enumerate(self.transfers):
+            transfer.tx_buf = ctypes.addressof(self.tx) + index
+            transfer.rx_buf = ctypes.addressof(self.rx) + index
+            transfer.len = 1
+            transfer.bits_per_word = 8
+        self.request = self.IOC_MESSAGE_BASE | (ctypes.sizeof(self.transfers) << 16)
+        self.timing = None  # 전송 구조체에 채운 (speed_hz, delay_usecs)
+
+    def xfer(self, data, speed_hz, delay_usecs):
+        if len(data) != self.length:
+            raise ValueError(f"버스트 길이 {len(data)} != {self.length}")
+        if (speed_hz, delay_usecs) != self.timing:
+            for transfer in self.transfers:
+                transfer.speed_hz = speed_hz
+                transfer.delay_usecs = delay_usecs
+            self.transfers[-1].delay_usecs = 0  # 마지막 바이트 뒤에는 바로 CS 해제
+            self.timing = (speed_hz, delay_usecs)
+        self.tx[:] = data
+        fcntl.ioctl(self.spi.fileno(), self.request, self.transfers)
+        return list(self.rx)
+
+    def close(self):
+        self.spi.close()
+
+
+class MockSpiDev:
+    """ATmega128_fan.c의 SPI 응답을 흉내 내는 모의 장치 (하드웨어 없는 재생 벤치마크용).
+
+    펌웨어처럼 응답은 버스트 시작 시점의 상태 프레임(ack는 직전 명령)이고,
+    서보는 50Hz 사다리꼴 슬루로 움직인다. 리셋 후 MOCK_REPRESS_DELAY가 지나면 PD1을 누른 것으로 본다.
+    """
+
+    SERVO_FRAME = 0.02                   # 펌웨어 서보 작업 주기 (초)
+    DEGREES_PER_COUNT = 160.0 / 470.0    # 기존 4us OCR 카운트 1개 (10~170도 = 140~610)
+    SLEW_MAX_STEP = FIRMWARE_PARAM_DEFAULTS['slew_max_step']  # 기존 단위
+    REPRESS_DELAY = 1.0
+    PARAM_DEFAULTS = [FIRMWARE_PARAM_DEFAULTS[name]
+                      for name in sorted(FIRMWARE_PARAM_IDS, key=FIRMWARE_PARAM_IDS.get)]  # 설정 번호 순서
+
+    def __init__(self):
+        self.status = STATUS_READY       # 사용자가 이미 PD1을 누른 상태에서 시작
+        self.user_ready = True
+        self.running = False
+        self.angle = float(CENTER_ANGLE)
+        self.target = float(CENTER_ANGLE)
+        self.velocity = 0.0
+        self.max_step = self.SLEW_MAX_STEP
+        self.speed_level = 0
+        self.power = 0
+        self.stamp = 0                   # 상태 프레임 echo
+        self.echo_param = False          # echo가 OP_GET_PARAM 값
+        self.ack_seq = 0
+        self.ack_result = ACK_OK
+        self.reset_time = None
+        self.params = list(self.PARAM_DEFAULTS)
+        self.saved_params = list(self.PARAM_DEFAULTS)  # 모의 EEPROM
+        self.last_step = time.monotonic()
+        self.trace = []                  # (시각, seq, 명령 각도, speed 바이트, 서보 각도, 처리 결과)
+
+    def close(self):
+        pass
+
+    def _advance(self, now):
+        # 지난 서보 프레임 수만큼 슬루 엔진 실행
+        while now - self.last_step >= self.SERVO_FRAME:
+            self.last_step += self.SERVO_FRAME
+            target = self.target if self.running else float(CENTER_ANGLE)
+            error = target - self.angle
+            accel = self.params[1] * self.DEGREES_PER_COUNT
+            if self.velocity * error < 0:
+                # 펌웨어처럼 원래 방향으로 감속해 멈춘 뒤 다시 가속
+                self.velocity = math.copysign(max(abs(self.velocity) - accel, 0.0), self.velocity)
+                self.angle = min(max(self.angle + self.velocity, FIRMWARE_ANGLE10_MIN / 10.0),
+                                 FIRMWARE_ANGLE10_MAX / 10.0)
                 continue
-            
-            # 대기 화면 표시
-            display = frame.copy()
-            overlay = np.zeros_like(display)
-            cv2.rectangle(overlay, (0, FRAME_HEIGHT//2-70), (FRAME_WIDTH, FRAME_HEIGHT//2+70), (0, 0, 0), -1)
-            cv2.addWeighted(overlay, 0.7, display, 0.3, 0, display)
-            
-            cv2.putText(display, "Press PD1 Button to Start", (FRAME_WIDTH//2-260, FRAME_HEIGHT//2-20), 
-                       cv2.FONT_HERSHEY_SIMPLEX, 1.1, (0, 255, 255), 2)
-            cv2.putText(display, "Model Loaded - Ready", (FRAME_WIDTH//2-190, FRAME_HEIGHT//2+20), 
-                       cv2.FONT_HERSHEY_SIMPLEX, 0.9, (0, 255, 0), 2)
-            
-            cv2.imshow("Smart Fan Controller", display)
-            if cv2.waitKey(1) & 0xFF == ord('q'):
-                break
-            
-            # ATmega 상태 폴링
-            try:
-                response = spi.xfer2([POLL_COMMAND])
-                if response and response[0] == STATUS_READY:
-                    print("✓ ATmega 준비 완료 (111 수신)")
-                    print("✓ 서보모터 90도 위치 확인")
-                    
-                    # 팬 시작 명령
-                    time.sleep(0.1)
-                    response_start = spi.xfer2([START_COMMAND])
-                    print(f"✓ 팬 시작 명령(255) 전송, 응답: {response_start[0] if response_start else 'None'}")
-                    
-                    # 상태 전환
-                    current_angle = CENTER_ANGLE
-                    current_state = 'IDLE'
-                    last_direction = 'none'
-                    frame_count = 0
-                    start_time = time.time()
-                    
-                    print("✓ 객체 탐지 시작!\n")
-            except Exception as e:
-                print(f"폴링 오류: {e}")
-            
-            time.sleep(0.3)
-            continue
+            speed = abs(self.velocity)
+            if abs(error) * 2 * accel <= speed * speed:
+                speed = max(speed - accel, accel)
+            else:
+                speed = min(speed + accel, self.max_step * self.DEGREES_PER_COUNT)
+            if speed >= abs(error):
+                self.angle, self.velocity = target, 0.0
+            else:
+                self.angle += math.copysign(speed, error)
+                self.velocity = math.copysign(speed, error)
 
-        # ========== [상태 2] 정지 상태 (리셋 후) ==========
-        if current_state == 'STOPPED':
-            if last_frame is not None:
-                display = last_frame.copy()
+        if not self.running and not self.user_ready and self.reset_time is not None \
+                and now - self.reset_time >= self.REPRESS_DELAY:
+            self.user_ready = True
+        if self.running:
+            self.status = STATUS_RUNNING
+        elif self.user_ready and self.angle == CENTER_ANGLE:
+            self.status = STATUS_READY
+        else:
+            self.status = STATUS_HOMING_OFF
+
+    def _status_frame(self):
+        angle10 = int(round(self.angle * 10))
+        rpm = 900 + 18 * self.power if self.running else 0
+        body = [self.status, self.ack_seq, self.ack_result, angle10 & 0xFF, angle10 >> 8,
+                self.speed_level | (SPEED_FLAG_PARAM if self.echo_param else 0),
+                rpm & 0xFF, rpm >> 8, self.stamp & 0xFF, self.stamp >> 8]
+        return [SPI_STATUS_HEADER] + body + [crc8(body)]
+
+    def _handle(self, data, now):
+        if len(data) != SPI_FRAME_LEN or data[0] != SPI_CMD_HEADER or crc8(data[1:-1]) != data[-1]:
+            self.ack_result = 1  # ACK_CRC_ERROR
+            return
+        opcode, value, speed, slew = data[1], data[2] | (data[3] << 8), data[4], data[5]
+        result = ACK_OK
+        if opcode == OP_START:
+            if self.status == STATUS_READY:
+                self.running = True
+                self.power = self.speed_level = 0
             else:
-                ret, display = cap.read()
-                if not ret:
-                    continue
-            
-            # 정지 화면 표시
-            overlay = np.zeros_like(display)
-            cv2.rectangle(overlay, (0, FRAME_HEIGHT//2-90), (FRAME_WIDTH, FRAME_HEIGHT//2+90), (0, 0, 0), -1)
-            cv2.addWeighted(overlay, 0.7, display, 0.3, 0, display)
-            
-            cv2.putText(display, "SYSTEM STOPPED", (FRAME_WIDTH//2-200, FRAME_HEIGHT//2-40), 
-                       cv2.FONT_HERSHEY_SIMPLEX, 1.3, (0, 0, 255), 3)
-            cv2.putText(display, "Fan OFF - Servo at 90deg", (FRAME_WIDTH//2-230, FRAME_HEIGHT//2+5), 
-                       cv2.FONT_HERSHEY_SIMPLEX, 0.8, (255, 255, 255), 2)
-            cv2.putText(display, "Press PD1 to Restart", (FRAME_WIDTH//2-200, FRAME_HEIGHT//2+45), 
-                       cv2.FONT_HERSHEY_SIMPLEX, 0.9, (255, 255, 0), 2)
-            
-            cv2.imshow("Smart Fan Controller", display)
-            if cv2.waitKey(100) & 0xFF == ord('q'):
-                break
-            
-            # ATmega 상태 폴링
-            try:
-                response = spi.xfer2([POLL_COMMAND])
-                if response and response[0] == STATUS_READY:
-                    print("\n✓ 사용자가 PD1 버튼을 눌렀습니다")
-                    print("✓ 시스템 재시작 준비...\n")
-                    current_state = 'WAITING_BUTTON'
-            except Exception as e:
-                print(f"폴링 오류: {e}")
-            
-            time.sleep(0.5)
-            continue
+                result = 2  # ACK_REJECTED
+        elif opcode == OP_RESET:
+            self.running = False
+            self.user_ready = False
+            self.reset_time = now
+        elif opcode == OP_TRACK:
+            if not self.running or not self.params[2] <= value <= self.params[3]:
+                result = 2
+            else:
+                self.target = value / 10.0
+                self.stamp = data[6] | (data[7] << 8)
+                self.echo_param = False
+                if speed != SPEED_KEEP and speed & SPEED_POWER_FLAG:
+                    self.power = speed & ~SPEED_POWER_FLAG
+                    self.speed_level = (self.power + 25) // 50
+                elif speed <= 2:
+                    self.power, self.speed_level = speed * 50, speed
+                # 펌웨어처럼 명령 슬루는 설정 slew_max_step 이하의 임시 상한
+                limit = self.params[FIRMWARE_PARAM_IDS['slew_max_step']]
+                self.max_step = limit if slew == SLEW_KEEP or slew > limit else slew
+            self.trace.append((now, data[-2], value / 10.0, speed, self.angle, result))
+        elif opcode in (OP_SET_FAN_RAMP, OP_SET_PARAM):
+            result = self._set_param(FIRMWARE_PARAM_IDS['fan_ramp_ms'] if opcode == OP_SET_FAN_RAMP else speed,
+                                     value)
+        elif opcode == OP_GET_PARAM:
+            if speed < len(self.params):
+                self.stamp = self.params[speed]
+                self.echo_param = True
+            else:
+                result = 2
+        elif opcode == OP_SAVE_PARAMS:
+            if value == 1:
+                self.params = list(self.PARAM_DEFAULTS)
+                self.max_step = self.params[FIRMWARE_PARAM_IDS['slew_max_step']]
+            self.saved_params = list(self.params)
+        elif opcode != OP_POLL:
+            result = 3  # ACK_BAD_OPCODE
+        self.ack_seq = data[-2]
+        self.ack_result = result
 
-        # ========== [상태 3] 작동 중 (객체 탐지) ==========
-        ret, frame = cap.read()
+    def _set_param(self, param, value):
+        # 펌웨어 param_set()과 같은 범위 검사 (OCR이 작을수록 셈 -> 최약 > 최강)
+        current = {name: self.params[index] for name, index in FIRMWARE_PARAM_IDS.items()}
+        limits = {
+            'slew_max_step': (1, 255),
+            'slew_accel': (1, 255),
+            'angle10_min': (FIRMWARE_ANGLE10_MIN, FIRMWARE_ANGLE10_CENTER),
+            'angle10_max': (FIRMWARE_ANGLE10_CENTER, FIRMWARE_ANGLE10_MAX),
+            'duty_weakest': (current['duty_strongest'] + 1, FIRMWARE_FAN_OCR_WEAKEST),
+            'duty_strongest': (FIRMWARE_FAN_OCR_STRONGEST, current['duty_weakest'] - 1),
+            'fan_ramp_ms': (0, FIRMWARE_FAN_RAMP_MAX),
+        }
+        name = next((name for name, index in FIRMWARE_PARAM_IDS.items() if index == param), None)
+        if name is None or not limits[name][0] <= value <= limits[name][1]:
+            return 2
+        self.params[param] = value
+        if name == 'slew_max_step':
+            self.max_step = value
+        return ACK_OK
+
+    def xfer(self, data, speed_hz=0, delay_usecs=0):
+        now = time.monotonic()
+        self._advance(now)
+        response = self._status_frame()
+        self._handle(list(data), now)
+        return response
+
+
+def parse_status_frame(response):
+    """상태 프레임 -> dict. 헤더/길이/CRC가 맞지 않으면 None"""
+    if not response or len(response) != SPI_FRAME_LEN or response[0] != SPI_STATUS_HEADER:
+        return None
+    if crc8(response[1:-1]) != response[-1]:
+        return None
+    return {
+        'status': response[1],
+        'ack_seq': response[2],
+        'ack_result': response[3],
+        'angle': (response[4] | (response[5] << 8)) / 10.0,
+        'speed': response[6] & ~(SPEED_FLAG_STALL | SPEED_FLAG_PARAM),
+        'stalled': bool(response[6] & SPEED_FLAG_STALL),
+        'rpm': response[7] | (response[8] << 8),
+        'echo': response[9] | (response[10] << 8),
+        'echo_param': bool(response[6] & SPEED_FLAG_PARAM),  # echo = 설정값 (아니면 각도 명령 stamp)
+    }
+
+
+if MOCK_SPI:
+    print("✓ 모의 SPI 사용 (ATmega 없음)")
+else:
+    import spidev
+
+
+# ------------------- 객체 탐지 -------------------
+def make_blob(frames, size=None):
+    """blobFromImages(1/255, swapRB, crop=False)와 같은 결과를 미리 할당한 텐서에 기록 (프레임당 배치 1칸)"""
+    resize_buffer, blob_buffer = blob_buffers[size or input_size]
+    for index, frame in enumerate(frames):
+        cv2.resize(frame, resize_buffer.shape[1::-1], dst=resize_buffer, interpolation=cv2.INTER_LINEAR)
+        np.multiply(resize_buffer[:, :, ::-1].transpose(2, 0, 1), np.float32(1/255.0),
+                    out=blob_buffer[index], dtype=np.float32)
+    return blob_buffer[:len(frames)]
+
+
+def detect_persons(frames, region=None, size=None):
+    """카메라별 프레임을 한 배치로 추론하고 박스를 파이프라인 프레임(파노라마) 좌표로 돌려준다.
+
+    region=(x, y, w, h)이면 (카메라 1대일 때) 그 영역만 잘라서 추론한다.
+    size: 추론 입력 크기 (None이면 input_size, 재탐색 스캔은 search_input_size)
+    """
+    size = size or input_size
+    offset_x = offset_y = 0
+    if region is not None:
+        offset_x, offset_y, width, height = region
+        frames = [frames[0][offset_y:offset_y + height, offset_x:offset_x + width]]  # 복사 없는 뷰
+    started = time.perf_counter()
+    blob = make_blob(frames, size)
+    blob_done = time.perf_counter()
+    outputs = backend.infer(blob)  # (카메라 수, 4 + 클래스 수, 앵커 수)
+    forward_done = time.perf_counter()
+    if MULTI_CAMERA:
+        # 카메라마다 캔버스 위치로 바로 디코딩한 뒤, 화각이 겹치는 곳에서 두 번 잡힌 사람을 합친다
+        persons = [person for index, frame in enumerate(frames)
+                   for person in decode_persons(outputs[index], camera_tiles[index][1], frame.shape[0],
+                                                camera_tiles[index][0], 0, size)]
+        persons = merge_camera_overlaps(persons)
+    else:
+        persons = decode_persons(outputs[0], frames[0].shape[1], frames[0].shape[0], offset_x, offset_y, size)
+    latency.record('blob', blob_done - started)
+    latency.record('forward', forward_done - blob_done)
+    latency.record('decode', time.perf_counter() - forward_done)
+    return persons
+
+
+def roi_region(box, frame_shape):
+    """추적 박스를 ROI_EXPAND배 키운 정사각형 영역 (프레임 안으로 제한)"""
+    frame_height, frame_width = frame_shape[:2]
+    left, top, width, height = box
+    side = int(max(width, height) * ROI_EXPAND)
+    side = max(input_size, min(side, frame_width, frame_height))
+    center_x = left + width / 2
+    center_y = top + height / 2
+    x = int(min(max(center_x - side / 2, 0), frame_width - side))
+    y = int(min(max(center_y - side / 2, 0), frame_height - side))
+    return (x, y, side, side)
+
+
+def decode_persons(outputs, frame_width, frame_height, offset_x=0, offset_y=0, size=None):
+    """YOLOv8 출력 전체를 한 번에 디코딩해서 사람 박스 목록을 만든다."""
+    if PERSON_ONLY_DECODE:
+        scores = outputs[4 + PERSON_CLASS_ID]
+        mask = scores >= confidence_threshold
+    else:
+        class_scores = outputs[4:]
+        class_ids = class_scores.argmax(axis=0)
+        scores = class_scores[class_ids, np.arange(class_scores.shape[1])]
+        mask = (class_ids == PERSON_CLASS_ID) & (scores >= confidence_threshold)
+
+    if not mask.any():
+        return []
+
+    # 박스 일괄 변환 (cx, cy, w, h -> left, top, width, height)
+    cx, cy, w, h = outputs[:4, mask]
+    scores = scores[mask]
+    x_factor = frame_width / (size or input_size)
+    y_factor = frame_height / (size or input_size)
+    left = ((cx - w / 2) * x_factor).astype(np.int32) + offset_x
+    top = ((cy - h / 2) * y_factor).astype(np.int32) + offset_y
+    width = (w * x_factor).astype(np.int32)
+    height = (h * y_factor).astype(np.int32)
+    boxes = np.stack([left, top, width, height], axis=1)
+
+    # 겹치는 박스 제거
+    keep = cv2.dnn.NMSBoxes(boxes.tolist(), scores.tolist(), confidence_threshold, nms_threshold)
+    detected_persons = []
+    for i in np.array(keep, dtype=np.int32).reshape(-1):
+        box_left, box_top, box_width, box_height = (int(v) for v in boxes[i])
+        detected_persons.append({
+            'center_x': box_left + box_width / 2,
+            'box': [box_left, box_top, box_width, box_height],
+            'area': box_width * box_height,
+            'confidence': float(scores[i]),
+        })
+    return detected_persons
+
+
+def merge_camera_overlaps(persons):
+    """카메라 경계에서 겹치는 박스는 신뢰도가 높은 쪽만 남긴다 (카메라 간 NMS)"""
+    if len(persons) < 2:
+        return persons
+    keep = cv2.dnn.NMSBoxes([p['box'] for p in persons], [p['confidence'] for p in persons],
+                            confidence_threshold, nms_threshold)
+    return [persons[i] for i in np.array(keep, dtype=np.int32).reshape(-1)]
+
+
+class MotionDetector:
+    """축소 그레이스케일 프레임을 기준 프레임(마지막으로 탐지기를 돌린 프레임)과 비교해 장면 변화를 판단한다."""
+
+    def __init__(self):
+        self.small = np.empty((MOTION_HEIGHT, MOTION_WIDTH, 3), dtype=np.uint8)
+        self.gray = np.empty((MOTION_HEIGHT, MOTION_WIDTH), dtype=np.uint8)
+        self.reference = np.empty((MOTION_HEIGHT, MOTION_WIDTH), dtype=np.uint8)
+        self.diff = np.empty((MOTION_HEIGHT, MOTION_WIDTH), dtype=np.uint8)
+        self.has_reference = False
+
+    def reset(self):
+        self.has_reference = False
+
+    def changed(self, frame):
+        """기준 프레임 이후 움직임이 있으면 True (기준이 없으면 항상 True)"""
+        cv2.resize(frame, (MOTION_WIDTH, MOTION_HEIGHT), dst=self.small, interpolation=cv2.INTER_AREA)
+        cv2.cvtColor(self.small, cv2.COLOR_BGR2GRAY, dst=self.gray)
+        if not self.has_reference:
+            return True
+        cv2.absdiff(self.gray, self.reference, dst=self.diff)
+        cv2.threshold(self.diff, MOTION_PIXEL_THRESHOLD - 1, 255, cv2.THRESH_BINARY, dst=self.diff)
+        return cv2.countNonZero(self.diff) >= MOTION_AREA_RATIO * MOTION_WIDTH * MOTION_HEIGHT
+
+    def set_reference(self):
+        """마지막으로 changed()에 넣은 프레임을 기준으로 삼는다"""
+        np.copyto(self.reference, self.gray)
+        self.has_reference = True
+
+
+# ------------------- 추적 -------------------
+class FlowTracker:
+    """희소 광류(Lucas-Kanade)로 추적 박스를 다음 프레임으로 옮긴다 (탐지기 대신 쓰는 값싼 추적)."""
+
+    def __init__(self):
+        self.gray_buffers = [np.empty((FRAME_HEIGHT, FRAME_WIDTH), dtype=np.uint8) for _ in range(2)]
+        self.mask = np.zeros((FRAME_HEIGHT, FRAME_WIDTH), dtype=np.uint8)
+        self.prev_gray = None
+        self.points = None
+        self.target = None
+
+    def next_gray(self, frame):
+        # 이전 프레임이 쓰지 않는 버퍼에 변환
+        gray = self.gray_buffers[1] if self.prev_gray is self.gray_buffers[0] else self.gray_buffers[0]
+        cv2.cvtColor(frame, cv2.COLOR_BGR2GRAY, dst=gray)
+        return gray
+
+    def reset(self):
+        self.points = None
+        self.target = None
+
+    def start(self, gray, person):
+        left, top, width, height = person['box']
+        x0, y0 = max(left, 0), max(top, 0)
+        x1, y1 = min(left + width, FRAME_WIDTH), min(top + height, FRAME_HEIGHT)
+        if x1 <= x0 or y1 <= y0:
+            self.reset()
+            return
+        self.mask[:] = 0
+        self.mask[y0:y1, x0:x1] = 255
+        self.points = cv2.goodFeaturesToTrack(gray, TRACKER_MAX_POINTS, 0.01, 5, mask=self.mask)
+        self.target = dict(person)
+
+    def update(self, gray):
+        """이동한 대상(person dict)을 반환, 실패하면 None"""
+        if self.points is None or self.prev_gray is None or len(self.points) < TRACKER_MIN_POINTS:
+            return None
+        new_points, status, _ = cv2.calcOpticalFlowPyrLK(self.prev_gray, gray, self.points, None,
+                                                         winSize=(15, 15), maxLevel=2)
+        good = status.reshape(-1) == 1
+        if np.count_nonzero(good) < TRACKER_MIN_POINTS:
+            self.reset()
+            return None
+
+        # 특징점 이동량의 중앙값만큼 박스 이동
+        shift_x, shift_y = np.median((new_points[good] - self.points[good]).reshape(-1, 2), axis=0)
+        left, top, width, height = self.target['box']
+        left = int(round(left + shift_x))
+        top = int(round(top + shift_y))
+        self.points = new_points[good].reshape(-1, 1, 2)
+        self.target = {
+            'center_x': left + width / 2,
+            'box': [left, top, width, height],
+            'area': width * height,
+            'confidence': self.target['confidence'],
+            'id': self.target.get('id'),
+            'tracked': True,
+        }
+        return self.target
+
+
+def box_iou(boxes_a, boxes_b):
+    """[left, top, w, h] 박스 묶음 두 개의 IoU 행렬 (len(a) x len(b))"""
+    a = np.asarray(boxes_a, dtype=np.float32).reshape(-1, 4)
+    b = np.asarray(boxes_b, dtype=np.float32).reshape(-1, 4)
+    left = np.maximum(a[:, None, 0], b[None, :, 0])
+    top = np.maximum(a[:, None, 1], b[None, :, 1])
+    right = np.minimum(a[:, None, 0] + a[:, None, 2], b[None, :, 0] + b[None, :, 2])
+    bottom = np.minimum(a[:, None, 1] + a[:, None, 3], b[None, :, 1] + b[None, :, 3])
+    inter = np.clip(right - left, 0, None) * np.clip(bottom - top, 0, None)
+    union = a[:, None, 2] * a[:, None, 3] + b[None, :, 2] * b[None, :, 3] - inter
+    return inter / np.maximum(union, 1e-6)
+
+
+class TrackAssociator:
+    """탐지 결과에 프레임 간 유지되는 ID를 붙인다 (IoU 우선, 안 겹치면 center_x 거리로 매칭)."""
+
+    def __init__(self):
+        self.tracks = {}   # id -> {'box', 'center_x', 'last_seen'}
+        self.next_id = 1
+
+    def reset(self):
+        self.tracks.clear()
+
+    def update(self, persons, timestamp):
+        """persons 각각에 'id'를 채워서 그대로 반환"""
+        for track_id in [i for i, t in self.tracks.items() if timestamp - t['last_seen'] > ASSOC_MAX_AGE]:
+            del self.tracks[track_id]
+
+        # 점수가 높은 쌍부터 탐욕 매칭 (IoU 매칭 > 거리 매칭)
+        track_ids = list(self.tracks)
+        pairs = []
+        if track_ids and persons:
+            iou = box_iou([self.tracks[i]['box'] for i in track_ids], [p['box'] for p in persons])
+            for ti, track_id in enumerate(track_ids):
+                for di, person in enumerate(persons):
+                    distance = abs(self.tracks[track_id]['center_x'] - person['center_x']) / FRAME_WIDTH
+                    if iou[ti, di] >= ASSOC_IOU_MIN:
+                        pairs.append((1.0 + float(iou[ti, di]), track_id, di))
+                    elif distance <= ASSOC_MAX_DISTANCE:
+                        pairs.append((1.0 - distance, track_id, di))
+        pairs.sort(reverse=True)
+
+        assigned = {}
+        used = set()
+        for _, track_id, di in pairs:
+            if track_id in used or di in assigned:
+                continue
+            assigned[di] = track_id
+            used.add(track_id)
+
+        for di, person in enumerate(persons):
+            track_id = assigned.get(di)
+            if track_id is None:
+                track_id = self.next_id
+                self.next_id += 1
+            person['id'] = track_id
+            self.tracks[track_id] = {'box': person['box'], 'center_x': person['center_x'], 'last_seen': timestamp}
+        return persons
+
+
+class TargetFilter:
+    """center_x 등속 칼만 필터 (상태: 위치, 속도). 측정이 잠깐 끊기면 예측값으로 이어간다."""
+
+    def __init__(self):
+        self.kf = cv2.KalmanFilter(2, 1)
+        self.kf.measurementMatrix = np.array([[1, 0]], dtype=np.float32)
+        self.kf.measurementNoiseCov = np.array([[KALMAN_MEASUREMENT_NOISE]], dtype=np.float32)
+        self.last_time = None
+        self.last_measure_time = None
+
+    def reset(self):
+        self.last_time = None
+
+    def active(self, now):
+        return self.last_time is not None and now - self.last_measure_time <= TRACK_COAST_TIME
+
+    @property
+    def velocity(self):
+        """추정 속도 (px/s, +: 오른쪽)"""
+        return float(self.kf.statePost[1, 0]) if self.last_time is not None else 0.0
+
+    def _predict(self, now):
+        dt = max(now - self.last_time, 1e-3)
+        self.kf.transitionMatrix = np.array([[1, dt], [0, 1]], dtype=np.float32)
+        self.kf.processNoiseCov = KALMAN_PROCESS_NOISE * np.array(
+            [[dt ** 3 / 3, dt ** 2 / 2], [dt ** 2 / 2, dt]], dtype=np.float32)
+        self.last_time = now
+        return self.kf.predict()
+
+    def update(self, center_x, now):
+        if self.last_time is None:
+            self.kf.statePost = np.array([[center_x], [0]], dtype=np.float32)
+            self.kf.errorCovPost = np.diag([KALMAN_MEASUREMENT_NOISE, 1e4]).astype(np.float32)
+            self.last_time = self.last_measure_time = now
+            return center_x
+        self._predict(now)
+        self.kf.correct(np.array([[center_x]], dtype=np.float32))
+        self.last_measure_time = now
+        return float(self.kf.statePost[0, 0])
+
+    def predict(self, now):
+        # 측정 없이 예측만 (가림 구간, predict()가 statePost도 갱신함)
+        return float(self._predict(now)[0, 0])
+
+
+
+
+# ------------------- 스레드 작업 -------------------
+def capture_worker():
+    """카메라에서 계속 읽어서 최신 프레임만 남긴다.
+
+    프레임은 frame_ring 슬롯에 바로 읽어 넣고 (복사 없음), 소비자는 FrameRef 참조를 잡은 동안만 읽는다.
+    참조가 남은 슬롯은 덮어쓰지 않으므로, 오래 보관할 프레임은 복사 대신 참조를 계속 잡고 있으면 된다.
+    """
+    while not stop_event.is_set():
+        index = frame_ring.acquire_write(0.1)
+        if index is None:
+            continue  # 모든 슬롯을 누군가 잡고 있음 (소비자가 밀림)
+        frame, buffers = frame_ring.slots[index]
+        started = time.perf_counter()
+        if MULTI_CAMERA:
+            # 먼저 모두 grab한 뒤 retrieve해서 카메라 간 촬영 시각 차이를 줄인다
+            ret = all([capture.grab() for capture in caps])
+            frames = [capture.retrieve(buffer)[1] for capture, buffer in zip(caps, buffers)] if ret else []
+            ret = ret and all(camera_frame is not None for camera_frame in frames)
+        else:
+            ret, camera_frame = caps[0].read(frame)
+            frames = [camera_frame]
+        if ret:
+            # 백엔드가 버퍼를 못 쓰고 새 배열을 돌려준 경우만 링으로 복사
+            for buffer, camera_frame in zip(buffers, frames):
+                if camera_frame is not buffer:
+                    np.copyto(buffer, camera_frame)
+            if MULTI_CAMERA:
+                compose_panorama(frame, buffers)
+        latency.record('capture', time.perf_counter() - started)  # 다음 프레임 대기 포함
+        if not ret:
+            frame_ring.abort_write(index)
+        if not ret and BENCHMARK:
+            print("\n✓ 재생 끝")
+            stop_event.set()
+            break
         if not ret:
             print("프레임 읽기 실패")
+            time.sleep(0.01)
             continue
-        last_frame = frame.copy()
-
-        # 객체 탐지
-        blob = cv2.dnn.blobFromImage(frame, 1/255.0, (input_size, input_size), swapRB=True, crop=False)
-        net.setInput(blob)
-        outputs = net.forward(net.getUnconnectedOutLayersNames())[0].T
-
-        detected_persons = []
-        for detection in outputs:
-            classes_scores = detection[4:]
-            class_id = np.argmax(classes_scores)
-            confidence = classes_scores[class_id]
-            if confidence >= confidence_threshold and class_names[class_id] == 'person':
-                x_factor = frame.shape[1] / input_size
-                y_factor = frame.shape[0] / input_size
-                cx, cy, w, h = detection[:4]
-                left = int((cx - w / 2) * x_factor)
-                width = int(w * x_factor)
-                top = int((cy - h / 2) * y_factor)
-                height = int(h * y_factor)
-                detected_persons.append({
-                    'center_x': left + width / 2, 
-                    'box': [left, top, width, height], 
-                    'area': width * height
-                })
-        
-        person_detected = len(detected_persons) > 0
-        target_angle = current_angle
-
-        # 상태 전환 로직
-        if person_detected and current_state != 'TRACKING':
-            current_state = 'TRACKING'
-            print(f"→ TRACKING (사람 감지)")
-        elif not person_detected and current_state == 'TRACKING':
-            current_state = 'SEARCHING'
-            print(f"→ SEARCHING (사라짐, 방향: {last_direction})")
-
-        # 상태별 동작
-        if current_state == 'TRACKING':
-            # 사람 추적
-            target_person = max(detected_persons, key=lambda p: p['area'])
-            center_x = target_person['center_x']
-            dead_zone_width = FRAME_WIDTH * DEAD_ZONE_PERCENT
-            dead_zone_start = (FRAME_WIDTH / 2) - (dead_zone_width / 2)
-            dead_zone_end = (FRAME_WIDTH / 2) + (dead_zone_width / 2)
-
-            if center_x < dead_zone_start:
-                target_angle = current_angle - MOVE_SPEED
-                last_direction = 'left'
-            elif center_x > dead_zone_end:
-                target_angle = current_angle + MOVE_SPEED
-                last_direction = 'right'
-            else:
-                target_angle = current_angle
-                last_direction = 'none'
-
-        elif current_state == 'SEARCHING':
-            # 사라진 방향으로 계속 이동
-            if last_direction == 'left':
-                target_angle = current_angle - MOVE_SPEED
-            elif last_direction == 'right':
-                target_angle = current_angle + MOVE_SPEED
-            
-            # 끝 도달 시 대기
-            if target_angle <= MIN_ANGLE or target_angle >= MAX_ANGLE:
-                current_state = 'WAITING'
-                wait_start_time = time.time()
-                print(f"→ WAITING (끝 도달: {current_angle}도, 5초 대기)")
-
-        elif current_state == 'WAITING':
-            if person_detected:
-                current_state = 'TRACKING'
-                print(f"→ TRACKING (사람 재발견)")
-            elif time.time() - wait_start_time > RESET_TIMEOUT:
-                # 타임아웃: 초기화
-                print("\n" + "=" * 60)
-                print("⚠  5초 타임아웃: 시스템 초기화")
-                print("=" * 60)
-                
-                try:
-                    response = spi.xfer2([RESET_COMMAND])
-                    print(f"✓ 리셋 명령({RESET_COMMAND}) 전송")
-                    print(f"  ATmega 응답: {response[0] if response else 'None'}")
-                    print("✓ 팬 정지 및 서보 90도 복귀 시작")
-                    print("=" * 60 + "\n")
-                except Exception as e:
-                    print(f"✗ 리셋 명령 오류: {e}\n")
-                
-                current_state = 'STOPPED'
-                current_angle = CENTER_ANGLE
-                last_direction = 'none'
+        timestamp = time.monotonic()
+        ref = frame_ring.publish(index, timestamp)
+        frame_slot.put({'frame': frame, 'frames': buffers, 'ref': ref, 'timestamp': timestamp})
+        ref.release()  # 이제 frame_slot이 참조를 잡고 있음
+
+
+def compose_panorama(canvas, frames):
+    """카메라 영상을 파노라마 캔버스의 yaw 위치에 복사 (화면 표시/광역 좌표용, 추론은 원본 프레임 사용)"""
+    for camera_frame, (left, width) in zip(frames, camera_tiles):
+        tile = canvas[:, left:left + width]
+        if width == camera_frame.shape[1]:
+            np.copyto(tile, camera_frame)
+        else:
+            tile[:] = cv2.resize(camera_frame, (width, tile.shape[0]))
+
+
+def inference_worker():
+    """가장 최근 프레임에 대해서만 추론한다 (밀린 프레임은 건너뜀)."""
+    global reused_results
+    version = 0
+    frames_since_full = 0
+    frames_since_detect = 0
+    tracker = FlowTracker()
+    associator = TrackAssociator()
+    motion = MotionDetector()
+    last_result = None        # 마지막으로 탐지/광류로 만든 결과 (움직임이 없으면 재사용)
+    # centroid 정책/팬 여러 대는 매 프레임 모든 사람이 필요하므로 한 사람만 옮기는 광류 프레임을 쓰지 않음
+    # 카메라 여러 대는 파노라마 캔버스에 이음매가 있어 광류/ROI 없이 매 프레임 배치 탐지
+    flow_enabled = TRACKER_ENABLED and TARGET_POLICY != 'centroid' and not MULTI_FAN and not MULTI_CAMERA
+    held = None  # 처리 중인 프레임의 참조
+    while not stop_event.is_set():
+        if held is not None:
+            held.release()
+            held = None
+        if not inference_enabled.wait(0.1):
+            tracker.reset()
+            tracker.prev_gray = None
+            associator.reset()
+            motion.reset()
+            last_result = None
+            continue
+        version, item = frame_slot.get_newer(version, 0.1)
+        if item is None or not item['ref'].acquire():
+            continue  # 꺼내는 사이 새 프레임으로 바뀌어 덮어써짐
+        held = item['ref']
+        frame_consumed.set()
+        frame = item['frame']
+        target = roi_target
+
+        # 움직임 게이트: 마지막 결과 이후 장면이 그대로면 그 결과를 이 프레임으로 다시 발행
+        # (아무도 없을 때는 IDLE_INFERENCE_HZ까지 길게 재사용 = 저전력 대기)
+        idle = IDLE_DUTY_CYCLE and detector_idle()
+        gated = (MOTION_GATE or idle) and cameras_still()
+        if gated:
+            started = time.perf_counter()
+            moved = motion.changed(frame)
+            latency.record('motion', time.perf_counter() - started)
+            max_age = 1.0 / IDLE_INFERENCE_HZ if idle else MOTION_REUSE_MAX_AGE
+            if not moved and last_result is not None and item['timestamp'] - last_result['timestamp'] < max_age:
+                persons = associator.update(list(last_result['persons']), item['timestamp'])  # ID 유지 시각 갱신
+                detection_slot.put({'frame': frame, 'ref': held, 'timestamp': item['timestamp'], 'persons': persons,
+                                    'roi': last_result['roi']})
+                reused_results += 1
                 continue
 
-        elif current_state == 'IDLE':
-            target_angle = CENTER_ANGLE
-            if person_detected:
-                current_state = 'TRACKING'
-                print(f"→ TRACKING (사람 감지)")
+        # 추적 중에는 K 프레임 중 K-1 프레임을 광류로만 처리
+        gray = None
+        if flow_enabled:
+            gray = tracker.next_gray(frame)
+            tracked = None
+            if target is not None and frames_since_detect < TRACKER_DETECT_INTERVAL - 1:
+                started = time.perf_counter()
+                tracked = tracker.update(gray)
+                latency.record('flow', time.perf_counter() - started)
+            tracker.prev_gray = gray
+            if tracked is not None:
+                frames_since_detect += 1
+                associator.update([tracked], item['timestamp'])
+                last_result = {'frame': frame, 'ref': held, 'timestamp': item['timestamp'], 'persons': [tracked],
+                               'roi': None}
+                detection_slot.put(last_result)
+                if gated:
+                    motion.set_reference()
+                continue
+
+        # 추적 중이면 ROI만, 주기적으로/신뢰도가 낮으면 전체 프레임
+        region = None
+        if ROI_ENABLED and target is not None and frames_since_full < ROI_FULL_REFRESH \
+                and target['confidence'] >= ROI_MIN_CONFIDENCE:
+            region = roi_region(target['box'], frame.shape)
+
+        # 재탐색 스캔 중에는 작은 입력으로 (찾기만 하면 다음 프레임부터 원래 크기)
+        size = search_input_size if search_scan and region is None else None
+        persons = detect_persons(item['frames'], region, size)
+        if region is not None and not persons:
+            # ROI에서 놓치면 같은 프레임을 전체로 다시 탐지 (SEARCHING으로 잘못 빠지지 않게)
+            region = None
+            persons = detect_persons(item['frames'])
+        frames_since_full = frames_since_full + 1 if region is not None else 0
+        persons = associator.update(persons, item['timestamp'])
+        if gated:
+            motion.set_reference()
+
+        # 다음 프레임부터 추적할 대상 (제어가 고른 ID, 없으면 가장 큰 사람)
+        frames_since_detect = 0
+        if gray is not None:
+            if persons:
+                chosen = None
+                if target is not None and target.get('id') is not None:
+                    chosen = next((p for p in persons if p['id'] == target['id']), None)
+                tracker.start(gray, chosen or max(persons, key=lambda p: p['area']))
+            else:
+                tracker.reset()
+
+        last_result = {'frame': frame, 'ref': held, 'timestamp': item['timestamp'], 'persons': persons, 'roi': region}
+        detection_slot.put(last_result)
+
+
+def area_to_fan_power(area_ratio):
+    """박스 면적 비율 -> 팬 세기(%). 거리는 대략 1/sqrt(면적)에 비례하므로 sqrt 축에서 보간"""
+    near = FAN_AREA_NEAR ** 0.5
+    far = FAN_AREA_FAR ** 0.5
+    t = min(1.0, max(0.0, (area_ratio ** 0.5 - far) / (near - far)))
+    return int(round(FAN_POWER_FAR + (FAN_POWER_NEAR - FAN_POWER_FAR) * t))
+
+
+def set_inference(name, enabled):
+    """팬 하나라도 작동 중이면 추론 (탐지는 팬 수와 무관하게 프레임당 1번)"""
+    with inference_users_lock:
+        if enabled:
+            inference_users.add(name)
+        else:
+            inference_users.discard(name)
+        if inference_users:
+            inference_enabled.set()
+        else:
+            inference_enabled.clear()
+
+
+def detector_idle():
+    """작동 중인 팬이 모두 IDLE_STATES면 True (아무도 없으니 탐지기를 낮은 주기로)"""
+    running = [fan for fan in fans if fan.name in inference_users]
+    return bool(running) and all(fan.current_state in IDLE_STATES for fan in running)
+
+
+def cameras_still():
+    """팬 머리에 달린 카메라가 모두 멈춰 있으면 True (도는 중이면 화면이 비슷해도 박스의 각도 기준이 달라짐)"""
+    for fan in fans:
+        if fan.camera_mounted and fan.name in inference_users:
+            if not fan.servo_history or abs(fan.servo_history[-1][1] - fan.current_angle) > CAMERA_STILL_TOLERANCE:
+                return False
+    return True
+
+
+class FanController:
+    """ATmega 1대(SPI CS 1개)의 상태 머신. 탐지 결과는 모든 팬이 detection_slot에서 같이 읽는다."""
+
+    def __init__(self, config, primary=False):
+        self.name = config['name']
+        self.region = config.get('region', (0.0, 1.0))
+        self.camera_mounted = config.get('camera_mounted', True) and not MULTI_CAMERA  # 카메라 여러 대는 고정 설치
+        self.angle_offset = config.get('angle_offset', 0.0)
+        self.primary = primary          # 화면 표시/ROI를 맡는 팬
+        self.tag = f"[{self.name}] " if MULTI_FAN else ''
+
+        if MOCK_SPI:
+            self.spi = MockSpiDev()
+        else:
+            self.spi = SpacedSpiDev(*config['spi'], SPI_SPEED_HZ)
+        pin = config.get('status_gpio')
+        self.status_line = StatusLine(pin, STATUS_IRQ_ENABLED and pin is not None and not MOCK_SPI)
+
+        self.current_state = 'WAITING_BUTTON'  # 초기: 버튼 대기
+        self.current_angle = CENTER_ANGLE
+        self.last_direction = 'none'
+        self.wait_start_time = 0
+        self.last_poll_time = 0
+
+        self.spi_seq = 0
+        self.last_track_seq = None
+        self.last_sent_angle = None
+        self.last_spi_time = 0
+        self.pending_stamps = {}  # 각도 명령 seq -> 보낸 stamp, 지연 측정용
+        self.servo_history = deque(maxlen=64)  # (시각, ATmega가 보고한 서보 각도)
+        self.fan_area_filtered = None   # 평활된 대상 박스 면적 비율
+        self.fan_power = None           # 보낼 팬 세기 (%), None이면 ATmega 설정 유지
+        self.fan_rpm = 0                # ATmega가 보고한 팬 회전수
+        self.fan_stalled = False
+        self.last_sent_power = None
 
-        # 각도 계산 및 SPI 전송
-        final_angle = int(max(MIN_ANGLE, min(MAX_ANGLE, target_angle)))
+        # FPS 계산
+        self.frame_count = 0
+        self.start_time = time.time()
+        self.last_frame = None
+        self.last_frame_ref = None  # last_frame이 덮어써지지 않게 잡아 둔 링 참조
+        self.last_persons = []
+        self.last_target = None
+        self.last_roi = None
+        self.last_detection_version = 0
+        self.target_id = None    # 현재 조준 중인 사람 ID
+        self.target_since = 0    # 현재 대상을 고른 시각
+        self.target_filter = TargetFilter()
+        self.last_sighting = None  # (캡처 시각, 대상 절대 각도, 각속도) 마지막 실제 탐지, 재탐색 예측용
+        self.search_angle = CENTER_ANGLE  # 재탐색 예측 각도 (스캔 반대편으로 넘어갈 때 다시 돌아옴)
+        self.search_direction = 1  # 스캔 방향 (+1: 오른쪽)
+        self.search_settle = 0     # 예측 각도 도착 후 남은 정지 탐지 프레임 (-1: 이동 중)
+        self.search_reversed = False
+
+        # ATmega 설정 요청 (제어 소켓 등 다른 스레드가 넣고 제어 스레드가 SPI로 처리)
+        self.firmware_requests = deque()
+        self.firmware_job = None  # 진행 중인 요청 (firmware_tick)
+        if FIRMWARE_PARAMS:
+            self.request_firmware(FIRMWARE_PARAMS, save=True)
+
+    def log(self, message):
+        # 앞쪽 빈 줄은 그대로 두고 팬 이름만 붙임
+        body = message.lstrip('\n')
+        print(message[:len(message) - len(body)] + self.tag + body)
+
+    def transact(self, opcode, value=0, speed=SPEED_KEEP, slew=SLEW_KEEP, stamp=0):
+        """명령 프레임 1개를 보내고 같은 버스트(CS 유지, 바이트마다 SPI_BYTE_DELAY_US 간격)에서 상태 프레임을 받는다.
+
+        상태 프레임의 ack_seq는 ATmega가 마지막으로 처리한 명령(보통 직전 전송)을 가리킨다.
+        stamp(16비트)는 ATmega가 각도 명령을 적용하면 상태 프레임의 echo로 돌아온다.
+        프레임이 깨졌으면 None을 반환한다.
+        """
+        self.spi_seq = (self.spi_seq + 1) & 0xFF
+        body = [opcode, value & 0xFF, (value >> 8) & 0xFF, speed, slew, stamp & 0xFF, (stamp >> 8) & 0xFF]
+        body += [0] * (SPI_FRAME_LEN - 3 - len(body)) + [self.spi_seq]  # 예약 바이트 후 시퀀스 (헤더/CRC 제외)
+        started = time.perf_counter()
+        response = self.spi.xfer([SPI_CMD_HEADER] + body + [crc8(body)], SPI_SPEED_HZ, SPI_BYTE_DELAY_US)
+        latency.record('spi', time.perf_counter() - started)
+
+        status = parse_status_frame(response)
+        if status is not None:
+            status['seq'] = self.spi_seq
+
+        # 설정 명령 C 다음 버스트면 그 ack 확인 (C 자신의 버스트는 제외, OP_GET_PARAM은 echo가 설정값일 때만)
+        job = self.firmware_job
+        if job is not None and job['seq'] is not None and not job['checked'] and self.spi_seq != job['seq']:
+            job['checked'] = True
+            if status is not None and status['ack_seq'] == job['seq'] \
+                    and (job['command'][0] != OP_GET_PARAM or status['echo_param']):
+                job['reply'] = (status['ack_result'], status['echo'])
+        return status
+
+    def close(self):
+        self.spi.close()
+        self.status_line.close()
+
+    def request_firmware(self, values, save=False):
+        """ATmega 설정 변경(+EEPROM 저장)을 제어 스레드에 맡긴다. 끝나면 request['done']이 켜진다."""
+        request = {'set': dict(values), 'save': save, 'done': threading.Event(), 'result': None}
+        self.firmware_requests.append(request)
+        return request
+
+    def firmware_busy(self):
+        return self.firmware_job is not None or bool(self.firmware_requests)
+
+    def firmware_tick(self):
+        """제어 주기마다 설정 요청을 한 단계씩 진행한다 (기다리지 않음, 버스트 최대 2개).
+
+        ATmega는 ack/echo를 하나씩만 보관하므로 명령 C 바로 다음 버스트의 상태 프레임만 C를 확인할 수 있다.
+        C는 이번 주기 마지막에 보내고, 다음 주기의 첫 버스트(control_step의 명령이든 여기서 보내는 OP_POLL이든)를
+        transact가 확인한 뒤에 다음 명령으로 간다. 확인 못 하면 FIRMWARE_ACK_RETRIES번까지 다시 보낸다.
+        """
+        job = self.firmware_job
+        if job is None:
+            if not self.firmware_requests:
+                return
+            request = self.firmware_requests.popleft()
+            job = self.firmware_job = {
+                'request': request, 'steps': self.firmware_exchange(request['set'], request['save']),
+                'command': None, 'seq': None, 'checked': False, 'reply': None, 'attempts': 0,
+            }
+            if not self.firmware_advance(job, None):
+                return
+        try:
+            if job['seq'] is not None:
+                if not job['checked']:
+                    self.transact(OP_POLL)  # C 이후 버스트가 없었으면 확인용 폴링
+                # 확인됐거나 재전송을 다 썼으면 다음 명령, 아니면 같은 명령 다시 전송
+                if (job['reply'] is not None or job['attempts'] >= FIRMWARE_ACK_RETRIES) \
+                        and not self.firmware_advance(job, job['reply'] or (None, None)):
+                    return
+            opcode, value, speed = job['command']
+            self.transact(opcode, value, speed=speed)
+            job.update(seq=self.spi_seq, checked=False, reply=None, attempts=job['attempts'] + 1)
+        except Exception as e:
+            self.firmware_advance(job, None, error=e)
+
+    def firmware_advance(self, job, reply, error=None):
+        """설정 절차에 응답(또는 SPI 오류)을 넘기고 다음 명령을 받는다. 절차가 끝났으면 요청을 마무리하고 False."""
+        try:
+            job['command'] = job['steps'].throw(error) if error else job['steps'].send(reply)
+            job['attempts'] = 0
+            return True
+        except StopIteration as done:
+            result = done.value
+            applied = ', '.join(f"{name}={result['values'].get(name)}" for name in result['applied'])
+            self.log(f"✓ ATmega 설정: {applied or '조회'}{' (EEPROM 저장)' if result['saved'] else ''}"
+                     + (f", 거부 {result['rejected']}" if result['rejected'] else ''))
+        except Exception as e:
+            result = {'error': str(e)}
+            self.log(f"✗ ATmega 설정 오류: {e}")
+        self.firmware_job = None
+        job['request']['result'] = result
+        job['request']['done'].set()
+        return False
+
+    def firmware_commands(self, commands):
+        """(opcode, 값, speed 바이트)들을 하나씩 firmware_tick에 넘기고 명령마다 (처리 결과, echo)를 모은다.
+        확인 못 한 명령은 (None, None)."""
+        replies = []
+        for command in commands:
+            replies.append((yield command))
+        return replies
+
+    def firmware_exchange(self, values, save):
+        """OP_SET_PARAM(+OP_SAVE_PARAMS) 후 전체 설정값을 OP_GET_PARAM으로 다시 읽는 절차 (firmware_tick이 진행)."""
+        known = {name: int(value) for name, value in values.items() if name in FIRMWARE_PARAM_IDS}
+        rejected = [name for name in values if name not in FIRMWARE_PARAM_IDS]
+        pending = list(known)
+        for _ in range(2):
+            # 듀티 상/하한은 서로를 기준으로 검사하므로 거부된 것은 한 번 더 (보내는 순서 무관)
+            acks = yield from self.firmware_commands([(OP_SET_PARAM, known[name] & 0xFFFF, FIRMWARE_PARAM_IDS[name])
+                                                             for name in pending])
+            pending = [name for name, (result, _) in zip(pending, acks) if result != ACK_OK]
+            if not pending:
+                break
+        rejected += pending
+
+        saved = False
+        if save:
+            (result, _), = yield from self.firmware_commands([(OP_SAVE_PARAMS, 0, 0)])
+            saved = result == ACK_OK
+        names = list(FIRMWARE_PARAM_IDS)
+        replies = yield from self.firmware_commands([(OP_GET_PARAM, 0, FIRMWARE_PARAM_IDS[name]) for name in names])
+        return {
+            'applied': [name for name in known if name not in pending],
+            'rejected': rejected,
+            'saved': saved,
+            'values': {name: echo for name, (result, echo) in zip(names, replies) if result == ACK_OK},
+        }
+
+    def assigned_persons(self, persons):
+        """이 팬의 화면 구간(region) 안에 중심이 있는 사람만"""
+        left, right = self.region
+        return [p for p in persons if left <= p['center_x'] / FRAME_WIDTH <= right]
+
+    def select_target(self, persons, now):
+        """TARGET_POLICY에 따라 조준할 대상을 고른다. (대상, 대상이 바뀌었는지) 반환"""
+        current = next((p for p in persons if p.get('id') is not None and p['id'] == self.target_id), None)
+        largest = max(persons, key=lambda p: p['area'])
+
+        if TARGET_POLICY == 'centroid' and len(persons) > 1:
+            # 모든 사람의 중심 (박스는 합집합, 팬 세기는 가장 가까운 사람 기준)
+            left = min(p['box'][0] for p in persons)
+            top = min(p['box'][1] for p in persons)
+            right = max(p['box'][0] + p['box'][2] for p in persons)
+            bottom = max(p['box'][1] + p['box'][3] for p in persons)
+            return {
+                'center_x': sum(p['center_x'] for p in persons) / len(persons),
+                'box': [left, top, right - left, bottom - top],
+                'area': largest['area'],
+                'confidence': min(p['confidence'] for p in persons),
+                'id': None,
+            }, False
+
+        if TARGET_POLICY == 'sticky':
+            chosen = current
+            if chosen is None or largest['area'] > chosen['area'] * TARGET_SWITCH_RATIO:
+                chosen = largest
+        elif TARGET_POLICY == 'sweep':
+            chosen = current
+            if chosen is None:
+                chosen = largest
+            elif now - self.target_since >= TARGET_SWEEP_DWELL and len(persons) > 1:
+                # 왼쪽 -> 오른쪽 순서로 다음 사람
+                ordered = sorted(persons, key=lambda p: p['center_x'])
+                chosen = ordered[(ordered.index(current) + 1) % len(ordered)]
+        else:
+            chosen = largest
+
+        switched = chosen.get('id') != self.target_id
+        if switched:
+            self.target_id = chosen.get('id')
+            self.target_since = now
+        return chosen, switched
+
+    def servo_angle_at(self, timestamp):
+        """timestamp 시점의 서보 각도와 각속도 (ATmega 상태 프레임 기록으로 추정)"""
+        if not self.servo_history:
+            return self.current_angle, 0.0
+        previous = self.servo_history[0]
+        for sample in self.servo_history:
+            if sample[0] > timestamp:
+                break
+            previous = sample
+        rate = 0.0
+        index = self.servo_history.index(previous)
+        if index > 0:
+            before = self.servo_history[index - 1]
+            if previous[0] > before[0]:
+                rate = (previous[1] - before[1]) / (previous[0] - before[0])
+        return previous[1], rate
 
+    def camera_pose(self, capture_time):
+        """capture_time 시점 카메라 방향과 각속도 (팬 머리에 달렸으면 서보 각도, 아니면 고정)"""
+        if self.camera_mounted:
+            return self.servo_angle_at(capture_time)
+        return CENTER_ANGLE + self.angle_offset, 0.0
+
+    def pd_target_angle(self, center_x, pixel_velocity, capture_time, now):
+        """픽셀 오차를 화각으로 각도 오차로 바꾸고, 지연만큼 앞을 예측한 절대 목표 각도 (+: 오른쪽)"""
+        degrees_per_pixel = VIEW_HFOV / FRAME_WIDTH
+        camera_angle, camera_rate = self.camera_pose(capture_time)
+        error = (center_x - FRAME_WIDTH / 2) * degrees_per_pixel
+        # 대상의 절대 각속도 = 화면 안 이동 + 카메라 자체 회전
+        target_rate = pixel_velocity * degrees_per_pixel + camera_rate
+        lead = (now - capture_time) + PD_LATENCY
+        predicted_error = error + target_rate * lead
+        if not self.camera_mounted:
+            # 고정 카메라: 서보가 움직여도 화면 오차는 줄지 않으므로 오차 전체가 절대 각도
+            return camera_angle + predicted_error + PD_KD * target_rate, camera_angle + predicted_error - self.current_angle
+        return camera_angle + PD_KP * predicted_error + PD_KD * target_rate, predicted_error
+
+    def record_sighting(self, center_x, pixel_velocity, capture_time):
+        """대상이 실제로 탐지된 절대 각도/각속도를 기억 (사라지면 여기서부터 재탐색)"""
+        degrees_per_pixel = VIEW_HFOV / FRAME_WIDTH
+        camera_angle, camera_rate = self.camera_pose(capture_time)
+        self.last_sighting = (capture_time, camera_angle + (center_x - FRAME_WIDTH / 2) * degrees_per_pixel,
+                              pixel_velocity * degrees_per_pixel + camera_rate)
+
+    def start_search(self, now):
+        """SEARCHING 진입: 마지막 위치 + 각속도 x 경과 시간으로 지금 있을 각도를 예측"""
+        sighted_at, angle, rate = self.last_sighting
+        lead = min(now - sighted_at + PD_LATENCY, SEARCH_LEAD_MAX)
+        self.search_angle = round(max(MIN_ANGLE, min(MAX_ANGLE, angle + rate * lead)), 1)
+        if abs(rate) >= SEARCH_MIN_RATE:
+            self.search_direction = 1 if rate > 0 else -1
+        else:
+            self.search_direction = -1 if self.last_direction == 'left' else 1
+        self.search_settle = -1
+        self.search_reversed = False
+
+    def search_step(self):
+        """SEARCHING 1 프레임: 예측 각도로 이동 -> 잠깐 탐지 -> 진행 방향으로, 끝이면 반대쪽으로 스캔.
+
+        스캔은 서보가 직전 스캔 각도에 도착한 뒤에 한 칸씩 (명령 각도만 계속 더하면 끝까지 달아남).
+
+        양쪽 끝까지 훑어도 못 찾으면 None (WAITING으로).
+        """
+        servo_angle = self.servo_history[-1][1] if self.servo_history else self.current_angle
+        if self.search_settle < 0:
+            # 예측 각도로 이동 중 (보고된 서보 각도로 도착 확인)
+            if abs(servo_angle - self.search_angle) <= PD_DEAD_BAND:
+                self.search_settle = SEARCH_SETTLE_FRAMES
+            return self.search_angle
+        if self.search_settle > 0:
+            self.search_settle -= 1
+            return self.search_angle
+
+        if abs(servo_angle - self.current_angle) > PD_DEAD_BAND:
+            return self.current_angle  # 직전 스캔 각도로 아직 이동 중 (도착한 뒤의 탐지로 다음 칸 판단)
+        target_angle = self.current_angle + SEARCH_SCAN_STEP * self.search_direction
+        if MIN_ANGLE < target_angle < MAX_ANGLE:
+            return target_angle
+        if self.current_angle not in (MIN_ANGLE, MAX_ANGLE):
+            return target_angle  # 끝까지 한 번 더 (전송 시 MIN/MAX_ANGLE로 제한됨)
+        if self.search_reversed:
+            return None
+        # 이쪽 끝까지 훑었으면 예측 각도로 돌아가서 반대쪽 스캔
+        self.search_reversed = True
+        self.search_direction = -self.search_direction
+        self.search_settle = -1
+        return self.search_angle
+
+    def enter_stopped(self):
+        global roi_target, search_scan
+        set_inference(self.name, False)
+        if self.primary:
+            roi_target = None
+            search_scan = False
+        self.target_id = None   # 정지 화면은 last_frame_ref를 계속 잡고 있으므로 복사하지 않음
+        self.current_state = 'STOPPED'
+        self.current_angle = CENTER_ANGLE
+        self.last_direction = 'none'
+
+    def hold_frame(self, item):
+        """item의 프레임을 화면용 last_frame으로 잡는다 (화면을 맡은 팬만, 이미 덮어써졌으면 그대로)"""
+        if not self.primary or not item['ref'].acquire():
+            return
+        if self.last_frame_ref is not None:
+            self.last_frame_ref.release()
+        self.last_frame = item['frame']
+        self.last_frame_ref = item['ref']
+
+    def send_track_command(self, final_angle, power=None, capture_time=None):
+        """각도(+팬 세기) 명령 전송 + ATmega 상태 처리. 수동 정지가 감지되면 False.
+
+        capture_time이 있으면 그 프레임 캡처 시각(ms 하위 16비트)을 stamp로 실어 보내고, ATmega가 적용한 명령의
+        echo가 돌아오면 echo로 캡처 시각을 되살려 캡처 -> 적용 확인 수신(photon_to_command)을 기록한다.
+        echo는 다음 버스트에 오므로 명령 적용 후 RPi가 확인할 때까지의 왕복이 포함된다.
+        ATmega가 명령을 받아들인 시점까지이고, 서보가 그 각도에 도착하는 슬루 시간은 들어가지 않는다.
+        """
         try:
-            # 각도 전송 및 ATmega 상태 확인
-            response = spi.xfer2([final_angle])
-            atmega_status = response[0] if response else None
-            
+            # 각도 전송 및 ATmega 상태 확인 (한 번의 버스트)
+            slew = PD_SLEW_STEP if CONTROL_MODE == 'pd' else SLEW_KEEP
+            speed = SPEED_KEEP if power is None else SPEED_POWER_FLAG | power
+            stamp = int(capture_time * 1000) & 0xFFFF if capture_time is not None else 0
+            response = self.transact(OP_TRACK, int(round(final_angle * 10)), speed=speed, slew=slew, stamp=stamp)
+            atmega_status = response['status'] if response else None
+            if capture_time is not None:
+                self.pending_stamps[self.spi_seq] = stamp
+            if response:
+                self.servo_history.append((time.monotonic(), response['angle']))
+
+                # ATmega는 직전 프레임을 처리하므로 ack_seq 명령의 echo만 확정
+                received = time.monotonic()
+                stamp = self.pending_stamps.pop(response['ack_seq'], None)
+                if stamp is not None and response['ack_result'] == ACK_OK and not response['echo_param'] \
+                        and response['echo'] == stamp:
+                    # 받은 시각 기준으로 ms 하위 16비트가 echo인 가장 최근 시각 = 캡처 시각
+                    received_ms = int(received * 1000)
+                    capture_ms = received_ms - ((received_ms - response['echo']) & 0xFFFF)
+                    latency.record('photon_to_command', received - capture_ms / 1000)
+                for seq in [seq for seq in self.pending_stamps if seq != self.spi_seq]:
+                    del self.pending_stamps[seq]
+                self.fan_rpm = response['rpm']
+                if response['stalled'] != self.fan_stalled:
+                    self.fan_stalled = response['stalled']
+                    self.log("⚠ 팬 회전 없음 (정지 감지)" if self.fan_stalled else "✓ 팬 회전 복구")
+
+            # 직전 각도 명령이 실제로 적용됐는지 확인
+            if response and self.last_track_seq is not None and response['ack_seq'] == self.last_track_seq \
+                    and response['ack_result'] != ACK_OK:
+                self.log(f"⚠ 각도 명령 미적용 (seq {self.last_track_seq}): {ACK_NAMES.get(response['ack_result'])}")
+            self.last_track_seq = response['seq'] if response else None
+
             if atmega_status == STATUS_RUNNING:
                 # 정상 작동 중
-                current_angle = final_angle
-                
+                self.current_angle = final_angle
+
             elif atmega_status == STATUS_HOMING_OFF:
                 # 수동 정지 감지!
                 print("\n" + "=" * 60)
-                print("⚠  ATmega 수동 정지 감지 (PD1 버튼으로 끔)")
+                self.log("⚠  ATmega 수동 정지 감지 (PD1 버튼으로 끔)")
                 print("=" * 60)
                 print("✓ 팬 정지됨")
                 print("✓ 서보 90도 복귀 중")
                 print("=" * 60 + "\n")
-                current_state = 'STOPPED'
-                current_angle = CENTER_ANGLE
-                last_direction = 'none'
-                continue
-                
+                self.enter_stopped()
+                return False
+
+            elif atmega_status is None:
+                self.log("⚠ 상태 프레임 오류 (헤더/CRC 불일치)")
+
             elif atmega_status == STATUS_READY:
                 # 비정상 상태 (작동 중인데 READY는 이상함)
-                print(f"⚠ 상태 불일치: RPi={current_state}, ATmega=READY({atmega_status})")
-                
+                self.log(f"⚠ 상태 불일치: RPi={self.current_state}, ATmega=READY({atmega_status})")
+
             else:
-                print(f"⚠ 알 수 없는 ATmega 응답: {atmega_status}")
-                
+                self.log(f"⚠ 알 수 없는 ATmega 응답: {atmega_status}")
+
         except Exception as e:
-            print(f"SPI 통신 오류: {e}")
+            self.log(f"SPI 통신 오류: {e}")
+        return True
 
-        # 화면 표시
-        overlay = frame.copy()
-        alpha = 0.2
-        dz_start_px = int((FRAME_WIDTH / 2) - (FRAME_WIDTH * DEAD_ZONE_PERCENT / 2))
-        dz_end_px = int((FRAME_WIDTH / 2) + (FRAME_WIDTH * DEAD_ZONE_PERCENT / 2))
-        cv2.rectangle(overlay, (dz_start_px, 0), (dz_end_px, FRAME_HEIGHT), (255, 255, 0), -1)
-        cv2.addWeighted(overlay, alpha, frame, 1 - alpha, 0, frame)
+    def control_step(self):
+        """제어 주기 1회: 상태 머신 갱신 + SPI 전송 + 화면용 스냅샷 발행"""
+        global roi_target, search_scan
 
-        # FPS 계산
-        fps = (frame_count := frame_count + 1) / (time.time() - start_time) if time.time() > start_time else 0
-        
-        # 상태별 색상
-        state_colors = {
-            'IDLE': (0, 255, 255),
-            'TRACKING': (0, 255, 0),
-            'SEARCHING': (0, 165, 255),
-            'WAITING': (0, 0, 255)
-        }
-        state_color = state_colors.get(current_state, (255, 255, 255))
-        
-        # 정보 표시
-        cv2.putText(frame, f"FPS: {fps:.1f}", (20, 40), cv2.FONT_HERSHEY_SIMPLEX, 0.8, (0, 0, 255), 2)
-        cv2.putText(frame, f"Angle: {current_angle}", (20, 75), cv2.FONT_HERSHEY_SIMPLEX, 0.8, (255, 0, 0), 2)
-        cv2.putText(frame, f"State: {current_state}", (20, 110), cv2.FONT_HERSHEY_SIMPLEX, 0.8, state_color, 2)
-        
-        # WAITING 상태일 때 카운트다운 표시
-        if current_state == 'WAITING':
-            remaining = RESET_TIMEOUT - (time.time() - wait_start_time)
-            cv2.putText(frame, f"Reset: {remaining:.1f}s", (20, 145), 
-                       cv2.FONT_HERSHEY_SIMPLEX, 0.8, (0, 0, 255), 2)
-
-        # 사람 감지 시 박스 표시
-        if person_detected:
-            person_info = max(detected_persons, key=lambda p: p['area'])
-            box = person_info['box']
-            center_x = int(person_info['center_x'])
-            center_y = int(box[1] + box[3] / 2)
-            
-            cv2.rectangle(frame, (box[0], box[1]), (box[0] + box[2], box[1] + box[3]), (0, 255, 0), 2)
-            cv2.circle(frame, (center_x, center_y), 5, (0, 0, 255), -1)
-            cv2.line(frame, (center_x - 10, center_y), (center_x + 10, center_y), (0, 0, 255), 2)
-            cv2.line(frame, (center_x, center_y - 10), (center_x, center_y + 10), (0, 0, 255), 2)
-
-        cv2.imshow("Smart Fan Controller", frame)
-        if cv2.waitKey(1) & 0xFF == ord('q'):
-            break
+        now = time.monotonic()
+
+        # ========== [상태 1] 버튼 대기 (초기 시작) ==========
+        if self.current_state == 'WAITING_BUTTON':
+            _, item = frame_slot.peek()
+            if item is not None and self.primary:
+                view_slot.put({'state': self.current_state, 'frame': item['frame'], 'ref': item['ref'],
+                               'fans': fan_summary()})
+
+            # 상태 알림 에지 대기 (핀이 없으면 WAIT_POLL_INTERVAL 폴링)
+            # 설정 요청이 진행 중이면 제어 주기를 넘겨 기다리지 않음 (firmware_tick이 주기마다 진행)
+            wait = 1.0 / CONTROL_HZ if self.firmware_busy() else WAIT_POLL_INTERVAL
+            if not self.status_line.wait(wait) and now - self.last_poll_time < STATUS_SAFETY_POLL:
+                return
+            self.last_poll_time = time.monotonic()
+
+            # ATmega 상태 확인
+            try:
+                response = self.transact(OP_POLL)
+                if response and response['status'] == STATUS_READY:
+                    self.log("✓ ATmega 준비 완료 (111 수신)")
+                    self.log("✓ 서보모터 90도 위치 확인")
+
+                    # 팬 시작 명령
+                    response_start = self.transact(OP_START)
+                    self.log(f"✓ 팬 시작 명령 전송, 응답: {response_start['status'] if response_start else 'None'}")
+
+                    # 상태 전환
+                    self.current_angle = CENTER_ANGLE
+                    self.current_state = 'IDLE'
+                    self.last_direction = 'none'
+                    self.last_track_seq = None
+                    self.last_sent_angle = None
+                    self.servo_history.clear()
+                    self.fan_area_filtered = None
+                    self.target_id = None
+                    self.last_sighting = None
+                    self.fan_power = None
+                    self.last_sent_power = None
+                    self.frame_count = 0
+                    self.start_time = time.time()
+                    self.last_detection_version, _ = detection_slot.peek()
+                    set_inference(self.name, True)
+
+                    self.log("✓ 객체 탐지 시작!\n")
+            except Exception as e:
+                self.log(f"폴링 오류: {e}")
+            return
+
+        # ========== [상태 2] 정지 상태 (리셋 후) ==========
+        if self.current_state == 'STOPPED':
+            if self.last_frame is None:
+                _, item = frame_slot.peek()
+                if item is not None:
+                    self.hold_frame(item)
+            if self.last_frame is not None and self.primary:
+                view_slot.put({'state': self.current_state, 'frame': self.last_frame, 'ref': self.last_frame_ref,
+                               'fans': fan_summary()})
+
+            # 상태 알림 에지 대기 (핀이 없으면 STOP_POLL_INTERVAL 폴링)
+            # 설정 요청이 진행 중이면 제어 주기를 넘겨 기다리지 않음 (firmware_tick이 주기마다 진행)
+            wait = 1.0 / CONTROL_HZ if self.firmware_busy() else STOP_POLL_INTERVAL
+            if not self.status_line.wait(wait) and now - self.last_poll_time < STATUS_SAFETY_POLL:
+                return
+            self.last_poll_time = time.monotonic()
+
+            # ATmega 상태 확인
+            try:
+                response = self.transact(OP_POLL)
+                if response and response['status'] == STATUS_READY:
+                    self.log("\n✓ 사용자가 PD1 버튼을 눌렀습니다")
+                    self.log("✓ 시스템 재시작 준비...\n")
+                    self.current_state = 'WAITING_BUTTON'
+            except Exception as e:
+                self.log(f"폴링 오류: {e}")
+            return
+
+        # ========== [상태 3] 작동 중 (객체 탐지) ==========
+        target_angle = self.current_angle
+        fresh = False
+
+        # 새 탐지 결과가 있고 충분히 최신일 때만 상태 머신을 진행
+        version, result = detection_slot.peek()
+        if result is not None and version != self.last_detection_version:
+            self.last_detection_version = version
+            fresh = now - result['timestamp'] <= MAX_FRAME_AGE
+            if self.primary:
+                latency.record('frame_age', now - result['timestamp'])  # 캡처 -> 제어 스레드 도착
+
+        if fresh:
+            self.frame_count += 1
+            self.hold_frame(result)
+            detected_persons = self.assigned_persons(result['persons'])
+            self.last_persons = result['persons']
+            self.last_roi = result['roi']
+            person_detected = len(detected_persons) > 0
+
+            # 칼만 필터로 center_x 평활화, 짧은 가림은 예측값으로 유지
+            target_person = None
+            filtered_x = None
+            coasting = False
+            if person_detected:
+                target_person, switched = self.select_target(detected_persons, now)
+                if switched and self.current_state == 'TRACKING':
+                    self.log(f"→ 대상 변경 (ID {self.target_id})")
+                    self.target_filter.reset()  # 다른 사람으로 넘어갈 때 속도 추정이 튀지 않게
+                filtered_x = target_person['center_x']
+                if TRACKER_ENABLED:
+                    filtered_x = self.target_filter.update(filtered_x, result['timestamp'])
+            elif self.current_state == 'TRACKING' and TRACKER_ENABLED and self.target_filter.active(result['timestamp']):
+                filtered_x = self.target_filter.predict(result['timestamp'])
+                coasting = True
+            else:
+                self.target_filter.reset()
+            self.last_target = target_person
+
+            # 상태 전환 로직
+            if person_detected and self.current_state != 'TRACKING':
+                self.current_state = 'TRACKING'
+                self.log(f"→ TRACKING (사람 감지)")
+            elif not person_detected and not coasting and self.current_state == 'TRACKING':
+                self.current_state = 'SEARCHING'
+                if PREDICTIVE_SEARCH and self.camera_mounted and self.last_sighting is not None:
+                    self.start_search(now)
+                    self.log(f"→ SEARCHING (사라짐, 예측 각도: {self.search_angle}도, "
+                             f"스캔 방향: {'right' if self.search_direction > 0 else 'left'})")
+                else:
+                    self.log(f"→ SEARCHING (사라짐, 방향: {self.last_direction})")
+
+            # 추적 중이 아니면 ROI 해제 (다음 추론은 전체 프레임)
+            if self.current_state != 'TRACKING' and self.primary:
+                roi_target = None
+            if self.primary and not MULTI_FAN:
+                search_scan = self.current_state == 'SEARCHING' and PREDICTIVE_SEARCH
+
+            # 상태별 동작
+            if self.current_state == 'TRACKING':
+                # 사람 추적 (가림 중이면 마지막 ROI 유지)
+                if target_person is not None:
+                    if self.primary and not MULTI_FAN and not MULTI_CAMERA:
+                        roi_target = {'box': target_person['box'], 'confidence': target_person['confidence'],
+                                      'id': target_person.get('id')}
+
+                    # 박스 면적(거리 대용)으로 팬 세기 결정
+                    if FAN_AREA_MODE:
+                        area_ratio = target_person['area'] / (CAMERA_WIDTH * CAMERA_HEIGHT)
+                        if self.fan_area_filtered is None:
+                            self.fan_area_filtered = area_ratio
+                        else:
+                            self.fan_area_filtered += FAN_AREA_SMOOTHING * (area_ratio - self.fan_area_filtered)
+                        power = area_to_fan_power(self.fan_area_filtered)
+                        if self.fan_power is None or abs(power - self.fan_power) >= FAN_POWER_MIN_CHANGE:
+                            self.fan_power = power
+                center_x = filtered_x
+                if target_person is not None:
+                    self.record_sighting(center_x, self.target_filter.velocity if TRACKER_ENABLED else 0.0,
+                                         result['timestamp'])
+                dead_zone_width = FRAME_WIDTH * DEAD_ZONE_PERCENT
+                dead_zone_start = (FRAME_WIDTH / 2) - (dead_zone_width / 2)
+                dead_zone_end = (FRAME_WIDTH / 2) + (dead_zone_width / 2)
+
+                if CONTROL_MODE == 'pd':
+                    # 절대 목표 각도 한 번에 전송 (이동은 ATmega 슬루 엔진이 담당)
+                    pixel_velocity = self.target_filter.velocity if TRACKER_ENABLED else 0.0
+                    pd_angle, predicted_error = self.pd_target_angle(center_x, pixel_velocity,
+                                                                     result['timestamp'], now)
+                    if abs(predicted_error) < PD_DEAD_BAND:
+                        target_angle = self.current_angle
+                        self.last_direction = 'none'
+                    else:
+                        target_angle = pd_angle
+                        self.last_direction = 'left' if predicted_error < 0 else 'right'
+                elif center_x < dead_zone_start:
+                    target_angle = self.current_angle - MOVE_SPEED
+                    self.last_direction = 'left'
+                elif center_x > dead_zone_end:
+                    target_angle = self.current_angle + MOVE_SPEED
+                    self.last_direction = 'right'
+                else:
+                    target_angle = self.current_angle
+                    self.last_direction = 'none'
+
+            elif self.current_state == 'SEARCHING' and not self.camera_mounted:
+                # 고정 카메라: 서보를 돌려도 시야가 바뀌지 않으므로 탐색 없이 제자리에서 대기
+                self.current_state = 'WAITING'
+                self.wait_start_time = time.time()
+                self.log(f"→ WAITING (고정 카메라 시야 밖: {self.current_angle}도, 5초 대기)")
+
+            elif self.current_state == 'SEARCHING' and PREDICTIVE_SEARCH and self.last_sighting is not None:
+                # 예측 각도로 바로 이동 후 빠른 스캔
+                search_angle = self.search_step()
+                if search_angle is not None:
+                    target_angle = search_angle
+                else:
+                    self.current_state = 'WAITING'
+                    self.wait_start_time = time.time()
+                    self.log(f"→ WAITING (양쪽 스캔 끝: {self.current_angle}도, 5초 대기)")
+
+            elif self.current_state == 'SEARCHING':
+                # 사라진 방향으로 계속 이동
+                if self.last_direction == 'left':
+                    target_angle = self.current_angle - MOVE_SPEED
+                elif self.last_direction == 'right':
+                    target_angle = self.current_angle + MOVE_SPEED
+
+                # 끝 도달 시 대기
+                if target_angle <= MIN_ANGLE or target_angle >= MAX_ANGLE:
+                    self.current_state = 'WAITING'
+                    self.wait_start_time = time.time()
+                    self.log(f"→ WAITING (끝 도달: {self.current_angle}도, 5초 대기)")
+
+            elif self.current_state == 'IDLE':
+                target_angle = CENTER_ANGLE
+
+        # 대기 타임아웃은 탐지 결과와 무관하게 확인
+        if self.current_state == 'WAITING' and time.time() - self.wait_start_time > RESET_TIMEOUT:
+            # 타임아웃: 초기화
+            print("\n" + "=" * 60)
+            self.log("⚠  5초 타임아웃: 시스템 초기화")
+            print("=" * 60)
+
+            try:
+                response = self.transact(OP_RESET)
+                print("✓ 리셋 명령 전송")
+                print(f"  ATmega 응답: {response['status'] if response else 'None'}")
+                print("✓ 팬 정지 및 서보 90도 복귀 시작")
+                print("=" * 60 + "\n")
+            except Exception as e:
+                self.log(f"✗ 리셋 명령 오류: {e}\n")
+
+            self.enter_stopped()
+            return
+
+        # 각도 계산 및 SPI 전송 (새 결과가 없으면 현재 각도 유지 + 상태 확인)
+        final_angle = round(max(MIN_ANGLE, min(MAX_ANGLE, target_angle)), 1)
+
+        # 각도 변화가 없으면 상태 확인 주기까지 전송 생략
+        # 각도가 그대로여도 상태 알림(수동 정지 등)이 오면 바로 교환
+        # 팬 세기는 바뀐 경우에만 같은 프레임에 실어 보냄
+        power = self.fan_power if self.fan_power != self.last_sent_power else None
+        if (final_angle != self.last_sent_angle or now - self.last_spi_time >= STATUS_POLL_INTERVAL
+                or power is not None or self.status_line.is_set()):
+            self.last_sent_angle = final_angle
+            self.last_spi_time = now
+            if power is not None:
+                self.last_sent_power = power
+            if not self.send_track_command(final_angle, power, result['timestamp'] if fresh else None):
+                return
+
+        if fresh and self.last_frame is not None and self.primary:
+            # FPS 계산 (탐지 결과 기준)
+            fps = self.frame_count / (time.time() - self.start_time) if time.time() > self.start_time else 0
+            view_slot.put({
+                'state': self.current_state,
+                'frame': self.last_frame,
+                'ref': self.last_frame_ref,
+                'persons': self.last_persons,
+                'target': self.last_target,
+                'roi': self.last_roi,
+                'angle': self.current_angle,
+                'fan_power': self.last_sent_power,
+                'rpm': self.fan_rpm,
+                'stalled': self.fan_stalled,
+                'fps': fps,
+                'wait_remaining': RESET_TIMEOUT - (time.time() - self.wait_start_time),
+                'fans': fan_summary(),
+            })
+
+    def control_worker(self):
+        """고정 주기로 control_step을 실행한다 (팬마다 스레드 1개, 상태 알림 대기도 팬별)."""
+        period = 1.0 / CONTROL_HZ
+        next_tick = time.monotonic()
+        while not stop_event.is_set():
+            self.control_step()
+            self.firmware_tick()
+            next_tick += period
+            delay = next_tick - time.monotonic()
+            if delay > 0:
+                time.sleep(delay)
+            else:
+                next_tick = time.monotonic()  # 밀렸으면 주기 재정렬
+
+
+def fan_summary():
+    """화면 표시용: 팬 여러 대일 때 나머지 팬 상태 (1대면 빈 목록)"""
+    if not MULTI_FAN:
+        return []
+    return [{'name': fan.name, 'state': fan.current_state, 'angle': fan.current_angle,
+             'target': fan.last_target, 'region': fan.region} for fan in fans]
+
+
+fans = [FanController(config, primary=(index == 0)) for index, config in enumerate(FANS)]
+
+
+# ------------------- 화면 표시 -------------------
+def render_view(view):
+    """view를 그린 화면. 꺼내는 사이 프레임이 덮어써졌으면 None (다음 view를 기다림)"""
+    if not view['ref'].acquire():
+        return None
+    try:
+        started = time.perf_counter()
+        display = draw_view(view)
+        latency.record('render', time.perf_counter() - started)
+    finally:
+        view['ref'].release()
+    return display
+
+
+dead_zone_fill = np.full((DISPLAY_HEIGHT, DISPLAY_WIDTH, 3), (255, 255, 0), dtype=np.uint8)  # 데드존 색 판
+
+
+def draw_view(view):
+    frame = view['frame']
+    if frame.shape[1] == DISPLAY_WIDTH and frame.shape[0] == DISPLAY_HEIGHT:
+        display = frame.copy()
+    else:
+        display = cv2.resize(frame, (DISPLAY_WIDTH, DISPLAY_HEIGHT))
+    scale_x = DISPLAY_WIDTH / frame.shape[1]
+    scale_y = DISPLAY_HEIGHT / frame.shape[0]
+
+    # 대기 화면
+    if view['state'] == 'WAITING_BUTTON':
+        cv2.addWeighted(display, 0.3, display, 0, 0, display)  # 검은 판 0.7 합성과 같음 (판 할당 없이)
+
+        cv2.putText(display, "Press PD1 Button to Start", (DISPLAY_WIDTH//2-260, DISPLAY_HEIGHT//2-20),
+                   cv2.FONT_HERSHEY_SIMPLEX, 1.1, (0, 255, 255), 2)
+        cv2.putText(display, "Model Loaded - Ready", (DISPLAY_WIDTH//2-190, DISPLAY_HEIGHT//2+20),
+                   cv2.FONT_HERSHEY_SIMPLEX, 0.9, (0, 255, 0), 2)
+        draw_fans(display, view, scale_x)
+        return display
+
+    # 정지 화면
+    if view['state'] == 'STOPPED':
+        cv2.addWeighted(display, 0.3, display, 0, 0, display)
+
+        cv2.putText(display, "SYSTEM STOPPED", (DISPLAY_WIDTH//2-200, DISPLAY_HEIGHT//2-40),
+                   cv2.FONT_HERSHEY_SIMPLEX, 1.3, (0, 0, 255), 3)
+        cv2.putText(display, "Fan OFF - Servo at 90deg", (DISPLAY_WIDTH//2-230, DISPLAY_HEIGHT//2+5),
+                   cv2.FONT_HERSHEY_SIMPLEX, 0.8, (255, 255, 255), 2)
+        cv2.putText(display, "Press PD1 to Restart", (DISPLAY_WIDTH//2-200, DISPLAY_HEIGHT//2+45),
+                   cv2.FONT_HERSHEY_SIMPLEX, 0.9, (255, 255, 0), 2)
+        draw_fans(display, view, scale_x)
+        return display
+
+    # 작동 화면: 데드존 표시 (데드존 띠만 합성, 화면 전체 복사 없음)
+    alpha = 0.2
+    dz_start_px = max(0, int((DISPLAY_WIDTH / 2) - (DISPLAY_WIDTH * DEAD_ZONE_PERCENT / 2)))
+    dz_end_px = min(DISPLAY_WIDTH, int((DISPLAY_WIDTH / 2) + (DISPLAY_WIDTH * DEAD_ZONE_PERCENT / 2)) + 1)
+    band = display[:, dz_start_px:dz_end_px]
+    cv2.addWeighted(dead_zone_fill[:, :band.shape[1]], alpha, band, 1 - alpha, 0, band)
+
+    # 상태별 색상
+    state_colors = {
+        'IDLE': (0, 255, 255),
+        'TRACKING': (0, 255, 0),
+        'SEARCHING': (0, 165, 255),
+        'WAITING': (0, 0, 255)
+    }
+    state_color = state_colors.get(view['state'], (255, 255, 255))
+
+    # 정보 표시
+    cv2.putText(display, f"FPS: {view['fps']:.1f}", (20, 40), cv2.FONT_HERSHEY_SIMPLEX, 0.8, (0, 0, 255), 2)
+    cv2.putText(display, f"Angle: {view['angle']}", (20, 75), cv2.FONT_HERSHEY_SIMPLEX, 0.8, (255, 0, 0), 2)
+    cv2.putText(display, f"State: {view['state']}", (20, 110), cv2.FONT_HERSHEY_SIMPLEX, 0.8, state_color, 2)
+
+    fan_text = f"Fan: {view['rpm']} rpm" if view['fan_power'] is None else f"Fan: {view['fan_power']}% {view['rpm']} rpm"
+    if view['stalled']:
+        fan_text += " STALL"
+    cv2.putText(display, fan_text, (20, 145), cv2.FONT_HERSHEY_SIMPLEX, 0.8,
+               (0, 0, 255) if view['stalled'] else (255, 255, 0), 2)
+
+    # WAITING 상태일 때 카운트다운 표시
+    if view['state'] == 'WAITING':
+        cv2.putText(display, f"Reset: {view['wait_remaining']:.1f}s", (20, 180),
+                   cv2.FONT_HERSHEY_SIMPLEX, 0.8, (0, 0, 255), 2)
+
+    # ROI 추론 영역 표시
+    if view['roi'] is not None:
+        x, y, w, h = view['roi']
+        cv2.rectangle(display, (int(x * scale_x), int(y * scale_y)),
+                      (int((x + w) * scale_x), int((y + h) * scale_y)), (255, 0, 255), 1)
+
+    # 사람 박스 + ID (조준 대상은 초록)
+    target = view['target']
+    for person_info in view['persons']:
+        box = [int(person_info['box'][0] * scale_x), int(person_info['box'][1] * scale_y),
+               int(person_info['box'][2] * scale_x), int(person_info['box'][3] * scale_y)]
+        is_target = target is not None and person_info.get('id') is not None and person_info['id'] == target.get('id')
+        color = (0, 255, 0) if is_target else (160, 160, 160)
+        cv2.rectangle(display, (box[0], box[1]), (box[0] + box[2], box[1] + box[3]), color, 2)
+        if person_info.get('id') is not None:
+            cv2.putText(display, f"ID {person_info['id']}", (box[0], max(box[1] - 8, 15)),
+                       cv2.FONT_HERSHEY_SIMPLEX, 0.6, color, 2)
+
+    # 조준점 (centroid 정책이면 여러 사람의 중심)
+    if target is not None:
+        box = [int(target['box'][0] * scale_x), int(target['box'][1] * scale_y),
+               int(target['box'][2] * scale_x), int(target['box'][3] * scale_y)]
+        center_x = int(target['center_x'] * scale_x)
+        center_y = int(box[1] + box[3] / 2)
+
+        cv2.circle(display, (center_x, center_y), 5, (0, 0, 255), -1)
+        cv2.line(display, (center_x - 10, center_y), (center_x + 10, center_y), (0, 0, 255), 2)
+        cv2.line(display, (center_x, center_y - 10), (center_x, center_y + 10), (0, 0, 255), 2)
+
+    draw_fans(display, view, scale_x)
+    return display
+
+
+def draw_fans(display, view, scale_x):
+    """팬 여러 대: 팬별 담당 구간 경계, 상태/각도, 조준 대상"""
+    for index, fan in enumerate(view.get('fans', [])):
+        left, right = fan['region']
+        for edge in (left, right):
+            if 0.0 < edge < 1.0:
+                x = int(edge * DISPLAY_WIDTH)
+                cv2.line(display, (x, 0), (x, DISPLAY_HEIGHT), (255, 255, 255), 1)
+        cv2.putText(display, f"{fan['name']}: {fan['state']} {fan['angle']}", (DISPLAY_WIDTH - 260, 30 + 25 * index),
+                   cv2.FONT_HERSHEY_SIMPLEX, 0.6, (255, 255, 255), 2)
+        if fan['target'] is not None:
+            x = int(fan['target']['center_x'] * scale_x)
+            cv2.putText(display, fan['name'], (x - 20, DISPLAY_HEIGHT - 15), cv2.FONT_HERSHEY_SIMPLEX, 0.6, (0, 0, 255), 2)
+
+
+# ------------------- MJPEG 미리보기 -------------------
+class PreviewHandler(BaseHTTPRequestHandler):
+    """저속 MJPEG 스트림 (그리기/인코딩은 이 스레드에서만, 제어 경로와 분리)"""
+
+    def do_GET(self):
+        if self.path == '/metrics':
+            # 단계별 지연 p50/p99/히스토그램 (JSON)
+            body = json.dumps(latency.snapshot(), indent=1).encode()
+            self.send_response(200)
+            self.send_header('Content-Type', 'application/json')
+            self.send_header('Content-Length', str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+            return
+
+        self.send_response(200)
+        self.send_header('Content-Type', 'multipart/x-mixed-replace; boundary=frame')
+        self.send_header('Cache-Control', 'no-cache')
+        self.end_headers()
+
+        version = 0
+        period = 1.0 / PREVIEW_FPS
+        try:
+            while not stop_event.is_set():
+                version, view = view_slot.get_newer(version, 1.0)
+                display = render_view(view) if view is not None else None
+                if display is None:
+                    continue
+                ok, jpeg = cv2.imencode('.jpg', display, [cv2.IMWRITE_JPEG_QUALITY, PREVIEW_JPEG_QUALITY])
+                if ok:
+                    self.wfile.write(b"--frame\r\nContent-Type: image/jpeg\r\n\r\n")
+                    self.wfile.write(jpeg.tobytes())
+                    self.wfile.write(b"\r\n")
+                time.sleep(period)
+        except (BrokenPipeError, ConnectionResetError):
+            pass
+
+    def log_message(self, *args):
+        pass
+
+
+def latency_export_worker():
+    """주기적으로 지연 통계를 파일로 쓴다 (읽는 쪽이 반쯤 쓴 파일을 보지 않게 교체)."""
+    while not stop_event.wait(LATENCY_EXPORT_INTERVAL):
+        try:
+            temp_path = LATENCY_EXPORT_PATH + '.tmp'
+            with open(temp_path, 'w') as f:
+                json.dump({'time': time.time(), 'stages': latency.snapshot()}, f, indent=1)
+            os.replace(temp_path, LATENCY_EXPORT_PATH)
+        except OSError as e:
+            print(f"⚠ 지연 통계 저장 실패: {e}")
+
+
+# ------------------- 제어 소켓 -------------------
+class ControlHandler(socketserver.StreamRequestHandler):
+    """한 줄에 JSON 명령 하나, 응답도 JSON 한 줄 (예: socat - UNIX-CONNECT:/tmp/smart_fan.sock)
+
+    {"cmd": "get"}                                 LIVE_CONFIG_KEYS 현재 값
+    {"cmd": "set", "values": {"MOVE_SPEED": 4}}    바로 적용 (LIVE_CONFIG_KEYS만)
+    {"cmd": "reload"}                              설정 파일을 다시 읽어 LIVE_CONFIG_KEYS + FIRMWARE_PARAMS 적용
+    {"cmd": "firmware", "set": {"slew_accel": 6}, "save": true, "fan": "fan0"}
+                                                   ATmega 설정 변경(+EEPROM 저장) 후 현재 값 (set/save/fan 생략 가능)
+    """
+
+    def handle(self):
+        for line in self.rfile:
+            try:
+                reply = control_command(json.loads(line))
+            except (ValueError, TypeError, AttributeError) as e:
+                reply = {'ok': False, 'error': str(e)}
+            self.wfile.write((json.dumps(reply, ensure_ascii=False) + '\n').encode())
+
+
+def set_live_config(values):
+    applied, errors = {}, {}
+    for name, value in values.items():
+        if name not in LIVE_CONFIG_KEYS:
+            errors[name] = '재시작해야 적용됨' if name in globals() else '알 수 없는 설정'
+            continue
+        try:
+            globals()[name] = applied[name] = convert_config_value(name, value)
+        except ValueError as e:
+            errors[name] = str(e)
+    if applied:
+        print(f"✓ 설정 변경: {', '.join(f'{name}={value}' for name, value in applied.items())}")
+    return {'ok': not errors, 'applied': list(applied), 'errors': errors}
+
+
+def config_differs(name, value):
+    """설정 파일 값이 실행 중인 값과 다른지 (모르는 이름/형식 오류도 다르다고 봄)"""
+    try:
+        return name not in globals() or convert_config_value(name, value) != globals()[name]
+    except ValueError:
+        return True
+
+
+def firmware_command(values, save, fan_name=None):
+    """팬(들)의 제어 스레드에 ATmega 설정 요청을 넣고 FIRMWARE_REQUEST_TIMEOUT까지 기다린다."""
+    targets = [fan for fan in fans if fan_name in (None, fan.name)]
+    if not targets:
+        return {'ok': False, 'error': f'알 수 없는 팬: {fan_name}'}
+    requests = [(fan, fan.request_firmware(values, save)) for fan in targets]
+    results = {}
+    for fan, request in requests:
+        done = request['done'].wait(FIRMWARE_REQUEST_TIMEOUT)
+        results[fan.name] = request['result'] if done else {'error': '응답 없음 (제어 스레드 정지?)'}
+    ok = all(not result.get('error') and not result.get('rejected') for result in results.values())
+    return {'ok': ok, 'fans': results}
+
+
+def control_command(request):
+    cmd = request.get('cmd')
+    if cmd == 'get':
+        return {'ok': True, 'values': {name: globals()[name] for name in LIVE_CONFIG_KEYS}}
+    if cmd == 'set':
+        return set_live_config(request.get('values', {}))
+    if cmd == 'reload':
+        config = read_config(args.config)
+        firmware = config.pop('FIRMWARE_PARAMS', None)
+        reply = set_live_config({name: value for name, value in config.items() if name in LIVE_CONFIG_KEYS})
+        reply['restart_required'] = [name for name, value in config.items()
+                                     if name not in LIVE_CONFIG_KEYS and config_differs(name, value)]
+        if firmware:
+            reply['firmware'] = firmware_command(firmware, save=True)
+            reply['ok'] = reply['ok'] and reply['firmware']['ok']
+        return reply
+    if cmd == 'firmware':
+        return firmware_command(request.get('set', {}), bool(request.get('save')), request.get('fan'))
+    return {'ok': False, 'error': f'알 수 없는 명령: {cmd}'}
+
+
+def start_control_server():
+    """제어 소켓 서버 시작 (남아 있는 소켓 파일은 지우고 새로 만듦)"""
+    if os.path.exists(CONTROL_SOCKET_PATH):
+        os.unlink(CONTROL_SOCKET_PATH)
+    server = socketserver.ThreadingUnixStreamServer(CONTROL_SOCKET_PATH, ControlHandler)
+    server.daemon_threads = True
+    threading.Thread(target=server.serve_forever, name='control-socket', daemon=True).start()
+    return server
+
+
+def print_benchmark_report(elapsed):
+    """재생 벤치마크 결과: 처리량, 단계별 지연, 각도 명령 기록(CSV)"""
+    stages = latency.snapshot()
+    detections = stages.get('forward', {}).get('total', 0)
+    flows = stages.get('flow', {}).get('total', 0)
+    results = detections + flows + reused_results
+    print("\n" + "=" * 60)
+    frames_read = caps[0].frames_read
+    print(f"  벤치마크: {', '.join(args.replay)} ({INFERENCE_BACKEND}, input {input_size}, 배치 {len(caps)})")
+    print("=" * 60)
+    print(f"  재생 프레임 {frames_read}개 / {elapsed:.1f}초 = {frames_read / max(elapsed, 1e-6):.1f} fps")
+    print(f"  탐지 {detections}회 + 광류 {flows}회 + 재사용 {reused_results}회 = {results / max(elapsed, 1e-6):.1f} 결과/초")
+    print(f"  {'단계':<16}{'p50':>9}{'p99':>9}{'max':>9}{'누적':>8}  (ms)")
+    for stage in LatencyStats.STAGES:
+        if stage in stages:
+            row = stages[stage]
+            print(f"  {stage:<16}{row['p50']:>9.2f}{row['p99']:>9.2f}{row['max']:>9.2f}{row['total']:>8}")
+
+    traces = [(fan.name, row) for fan in fans for row in fan.spi.trace]
+    if args.trace and traces:
+        traces.sort(key=lambda item: item[1][0])
+        with open(args.trace, 'w', newline='') as f:
+            writer = csv.writer(f)
+            writer.writerow(['time', 'fan', 'seq', 'command_angle', 'speed', 'servo_angle', 'result'])
+            start = traces[0][1][0]
+            for name, (t, seq, command, speed, angle, result) in traces:
+                writer.writerow([f"{t - start:.4f}", name, seq, command, speed, f"{angle:.1f}", result])
+        print(f"  각도 명령 {len(traces)}개 기록: {args.trace}")
+    print("=" * 60)
+
+
+preview_server = None
+control_server = None
+
+control_threads = [threading.Thread(target=fan.control_worker, name=f'control-{fan.name}', daemon=True)
+                   for fan in fans]
+threads = [
+    threading.Thread(target=capture_worker, name='capture', daemon=True),
+    threading.Thread(target=inference_worker, name='inference', daemon=True),
+] + control_threads
+if LATENCY_EXPORT_PATH:
+    threads.append(threading.Thread(target=latency_export_worker, name='latency', daemon=True))
+
+try:
+    print("\n" + "=" * 60)
+    print("  스마트 팬 제어 시스템 시작")
+    print("=" * 60)
+    print("  • PD1 버튼을 눌러 시스템을 시작하세요")
+    print("  • 종료: Ctrl+C" if HEADLESS else "  • 종료: 'q' 키")
+    if PREVIEW_PORT:
+        print(f"  • 미리보기: http://<라즈베리파이>:{PREVIEW_PORT}/ ({PREVIEW_FPS} fps), 지연 통계: /metrics")
+    if LATENCY_EXPORT_PATH:
+        print(f"  • 지연 통계: {LATENCY_EXPORT_PATH} ({LATENCY_EXPORT_INTERVAL:g}초마다)")
+    if CONTROL_SOCKET_PATH:
+        print(f"  • 설정 변경: {CONTROL_SOCKET_PATH} (JSON 한 줄, 예: {{\"cmd\": \"get\"}})")
+    print("=" * 60 + "\n")
+
+    bench_start = time.monotonic()
+    for thread in threads:
+        thread.start()
+
+    if PREVIEW_PORT:
+        preview_server = ThreadingHTTPServer(('', PREVIEW_PORT), PreviewHandler)
+        preview_server.daemon_threads = True
+        threading.Thread(target=preview_server.serve_forever, name='preview', daemon=True).start()
+    if CONTROL_SOCKET_PATH:
+        control_server = start_control_server()
+
+    if HEADLESS:
+        # 헤드리스: 그리기/복사 없이 제어 스레드만 유지 (SIGTERM도 정상 종료)
+        signal.signal(signal.SIGTERM, lambda signum, frame: sys.exit(0))
+        while any(thread.is_alive() for thread in control_threads):
+            control_threads[0].join(0.5)
+    else:
+        # 메인 스레드: 화면 표시 전용 (OpenCV GUI는 메인 스레드에서만 안전)
+        view_version = 0
+        while any(thread.is_alive() for thread in control_threads):
+            view_version, view = view_slot.get_newer(view_version, 0.1)
+            display = render_view(view) if view is not None else None
+            if display is not None:
+                cv2.imshow("Smart Fan Controller", display)
+            if cv2.waitKey(1) & 0xFF == ord('q'):
+                break
 
 finally:
     print("\n" + "=" * 60)
     print("프로그램 종료 중...")
-    cap.release()
-    cv2.destroyAllWindows()
+    stop_event.set()
+    if preview_server is not None:
+        preview_server.shutdown()
+    if control_server is not None:
+        control_server.shutdown()
+        os.unlink(CONTROL_SOCKET_PATH)
+    for thread in threads:
+        if thread.is_alive():
+            thread.join(timeout=2.0)
+    for capture in caps:
+        capture.release()
+    # 링 슬롯을 가리키는 뷰를 모두 놓은 뒤 닫고 지운다
+    view = display = None
+    for slot in (frame_slot, detection_slot, view_slot):
+        slot.clear()
+    for fan in fans:
+        fan.last_frame = None
+    frame_ring.close(unlink=True)
+    if not HEADLESS:
+        cv2.destroyAllWindows()
     try:
         print("최종 리셋 명령 전송...")
-        spi.xfer2([RESET_COMMAND])
+        for fan in fans:
+            fan.transact(OP_RESET)
         time.sleep(0.2)
-        spi.close()
+        for fan in fans:
+            fan.close()
+        if BENCHMARK:
+            print_benchmark_report(time.monotonic() - bench_start)
         print("✓ 종료 완료!")
     except Exception as e:
         print(f"✗ 종료 중 오류: {e}")
@@ -0,0 +1,112 @@
+"""
+person 단일 클래스 YOLOv8n 모델 빌드 (개발 PC에서 실행)
+
+- COCO 80개 클래스 헤드에서 person 채널만 남겨 분류 헤드를 1채널로 축소
+- ONNX (FP32) -> ONNX Runtime INT8 (QDQ, 정적 양자화)
+- TFLite INT8 / NCNN 내보내기 (ultralytics 내보내기 사용)
+- --dynamic-batch: ONNX 배치/입력 크기를 동적으로 (카메라 여러 대를 한 번에 추론, 재탐색용 작은 입력)
+  TFLite/NCNN은 배치 1, 입력 크기 고정
+
+사용 예:
+    python build_person_model.py --calib-dir calib_images --formats onnx tflite ncnn
+"""
+import argparse
+import glob
+import os
+
+import cv2
+import numpy as np
+
+PERSON_CLASS_ID = 0
+
+
+def prune_to_person(model):
+    """Detect 헤드의 분류 conv(cv3 마지막 층)에서 person 채널만 남긴다."""
+    import torch
+
+    detect = model.model.model[-1]
+    for branch in detect.cv3:
+        conv = branch[-1]
+        pruned = torch.nn.Conv2d(conv.in_channels, 1, kernel_size=1, bias=True)
+        pruned.weight.data = conv.weight.data[PERSON_CLASS_ID:PERSON_CLASS_ID + 1].clone()
+        pruned.bias.data = conv.bias.data[PERSON_CLASS_ID:PERSON_CLASS_ID + 1].clone()
+        branch[-1] = pruned
+
+    detect.nc = 1
+    detect.no = detect.reg_max * 4 + 1
+    model.model.nc = 1
+    model.model.yaml['nc'] = 1
+    model.model.names = {0: 'person'}
+    return model
+
+
+def load_calibration_blobs(calib_dir, input_size, limit):
+    """Raspberry_fan.py와 같은 전처리로 보정용 blob 생성"""
+    paths = sorted(glob.glob(os.path.join(calib_dir, '*.jpg')) + glob.glob(os.path.join(calib_dir, '*.png')))
+    blobs = []
+    for path in paths[:limit]:
+        image = cv2.imread(path)
+        if image is None:
+            continue
+        blobs.append(cv2.dnn.blobFromImage(image, 1/255.0, (input_size, input_size), swapRB=True, crop=False))
+    if not blobs:
+        raise SystemExit(f"오류: 보정 이미지가 없습니다 ({calib_dir})")
+    return blobs
+
+
+def quantize_onnx(fp32_path, int8_path, blobs):
+    from onnxruntime.quantization import CalibrationDataReader, QuantFormat, QuantType, quantize_static
+    import onnxruntime as ort
+
+    input_name = ort.InferenceSession(fp32_path, providers=['CPUExecutionProvider']).get_inputs()[0].name
+
+    class BlobReader(CalibrationDataReader):
+        def __init__(self):
+            self.iterator = iter(blobs)
+
+        def get_next(self):
+            blob = next(self.iterator, None)
+            return None if blob is None else {input_name: blob}
+
+    # QDQ 형식은 XNNPACK EP에서 INT8 커널로 실행됨
+    quantize_static(fp32_path, int8_path, BlobReader(),
+                    quant_format=QuantFormat.QDQ,
+                    activation_type=QuantType.QUInt8,
+                    weight_type=QuantType.QInt8,
+                    per_channel=True)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='person 전용 INT8 YOLOv8n 모델 빌드')
+    parser.add_argument('--weights', default='yolov8n.pt')
+    parser.add_argument('--imgsz', type=int, default=160, help='Raspberry_fan.py의 input_size와 같게')
+    parser.add_argument('--calib-dir', required=True, help='보정용 이미지 폴더 (실제 설치 환경 사진 권장)')
+    parser.add_argument('--calib-count', type=int, default=200)
+    parser.add_argument('--calib-yaml', default='coco128.yaml', help='TFLite INT8 보정 데이터셋')
+    parser.add_argument('--formats', nargs='+', default=['onnx'], choices=['onnx', 'tflite', 'ncnn'])
+    parser.add_argument('--dynamic-batch', action='store_true', help='ONNX 입력 배치/크기를 고정하지 않음 (CAMERAS 여러 대, SEARCH_INPUT_SIZE)')
+    args = parser.parse_args()
+
+    from ultralytics import YOLO
+
+    model = prune_to_person(YOLO(args.weights))
+    print("✓ 분류 헤드 축소: 80 -> 1 클래스")
+
+    if 'onnx' in args.formats:
+        fp32_path = model.export(format='onnx', imgsz=args.imgsz, simplify=True, dynamic=args.dynamic_batch)
+        int8_path = 'yolov8n_person_int8.onnx'
+        blobs = load_calibration_blobs(args.calib_dir, args.imgsz, args.calib_count)
+        quantize_onnx(fp32_path, int8_path, blobs)
+        print(f"✓ ONNX INT8 저장: {int8_path}")
+
+    if 'tflite' in args.formats:
+        tflite_path = model.export(format='tflite', imgsz=args.imgsz, int8=True, data=args.calib_yaml)
+        print(f"✓ TFLite INT8 저장: {tflite_path} (yolov8n_person_int8.tflite 로 복사해서 사용)")
+
+    if 'ncnn' in args.formats:
+        ncnn_path = model.export(format='ncnn', imgsz=args.imgsz)
+        print(f"✓ NCNN 저장: {ncnn_path} (yolov8n_person_ncnn_model 로 복사해서 사용)")
+
+
+if __name__ == '__main__':
+    main()
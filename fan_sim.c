@@ -0,0 +1,706 @@
+/**
+ * @file fan_sim.c
+ * @brief ATmega128_fan.c 호스트 시뮬레이터 (서보 추적 지연 / ISR 타이밍 프로파일)
+ * @details
+ * - 펌웨어 소스를 HOST_SIM으로 그대로 포함하고 HAL만 흉내냄
+ *   (Timer0 틱, SPI 슬레이브, 버튼, 팬 PWM + FG 타코)
+ * - 가상 라즈베리파이가 실제 명령 프레임을 바이트 단위로 보내고 각도 명령마다 목표 도달 시간을 출력
+ * - 슬루(-s)와 가속(-a)은 RPi와 같이 OP_SET_PARAM / OP_SAVE_PARAMS로 보내고, 끝에 EEPROM 블록을 다시 읽어 확인
+ * - SPI 바이트는 -c Hz 클럭, 바이트 사이 -g us 간격. ISR마다 최악 AVR 사이클만큼 걸리고 ISR은 차례로 실행됨.
+ *   SPDR 재적재가 늦으면 이전 바이트가 나가고, 다음 바이트 완료 전에 읽지 못한 바이트는 사라짐 (둘 다 깨진 프레임)
+ * - ISR 사이클 수는 isr_cycles.py(avr-objdump 목록)에서 받거나 아래 추정값 사용
+ * - 태스크 / 프레임 처리 시간은 호스트 ns: 변경 전후 비교용이며 AVR 사이클 수가 아님
+ *
+ * 빌드 / 실행 (AVR 툴체인 없이, 추정 ISR 사이클):
+ *   gcc -std=gnu11 -O2 -Wall -o fan_sim fan_sim.c
+ *   ./fan_sim [-s 슬루] [-a 가속] [-p 명령 주기 ms] [-c SPI Hz] [-g 바이트 간격 us] [-d 머무는 시간 ms] [-m 최대 ms]
+ * 계산한 사이클로 (isr_cycles.py 참고):
+ *   gcc -std=gnu11 -O2 -Wall $(python3 isr_cycles.py fan.lss) -o fan_sim fan_sim.c
+ */
+
+#define HOST_SIM
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* -------------------------------------------------------------------------- */
+/* AVR 라이브러리 대체 */
+/* -------------------------------------------------------------------------- */
+
+#define PROGMEM
+#define pgm_read_word(addr)   (*(addr))
+#define ATOMIC_RESTORESTATE   0
+#define ATOMIC_BLOCK(type)    for (uint8_t sim_atomic_once = 1; sim_atomic_once; sim_atomic_once = 0)
+
+/* -------------------------------------------------------------------------- */
+/* 시뮬레이션 하드웨어 상태 + HAL */
+/* -------------------------------------------------------------------------- */
+
+uint32_t sim_us = 0;                // 시뮬레이션 시각 (1us 단위)
+uint16_t sim_servo_ocr = 0;         // OCR1A
+uint16_t sim_fan_ocr = 0;           // OCR3A
+uint8_t sim_fan_on = 0;             // Timer3 출력 켜짐
+uint8_t sim_leds = 0;
+uint8_t sim_status_irq = 0;
+uint8_t sim_button_level = 0;       // 버튼 레벨 (비트 = 버튼 번호)
+uint8_t sim_button_irq = 0;         // INT0/INT1 허용
+uint8_t sim_spdr = 0;               // 다음 바이트에 슬레이브가 내보낼 값
+uint8_t sim_spi_ss = 0;             // 1 = RPi가 SS LOW (프레임 전송 중)
+uint8_t sim_eeprom[4096];           // EEPROM (main에서 지운 상태 0xFF로 채움)
+uint32_t sim_eeprom_busy_until = 0; // 진행 중인 바이트 쓰기 완료 시각
+uint32_t sim_eeprom_writes = 0;
+
+#define SIM_EEPROM_WRITE_US   3400  // ATmega128 EEPROM 바이트 쓰기 시간
+
+static inline void hal_servo_write(uint16_t ocr) { sim_servo_ocr = ocr; }
+static inline void hal_fan_write(uint16_t ocr) { sim_fan_ocr = ocr; }
+static inline void hal_fan_output(uint8_t on) { sim_fan_on = on; }
+static inline uint8_t hal_fan_output_enabled(void) { return sim_fan_on; }
+static inline void hal_leds_write(uint8_t leds) { sim_leds = leds; }
+static inline void hal_status_irq(uint8_t level) { sim_status_irq = level; }
+static inline uint8_t hal_button_level(uint8_t button) { return (sim_button_level >> button) & 1; }
+static inline uint8_t hal_tick_count(void) { return (sim_us % 1000) / 4; }
+static inline uint8_t hal_tick_pending(void) { return 0; }  // 틱 ISR은 1ms 경계에서 바로 실행
+static inline void hal_spi_write(uint8_t data) { sim_spdr = data; }
+static inline uint8_t hal_spi_selected(void) { return sim_spi_ss; }
+static inline uint8_t hal_spi_pending(void) { return 0; }  // SPI ISR은 바이트 끝에서 바로 실행
+static inline uint8_t hal_eeprom_ready(void) { return sim_us >= sim_eeprom_busy_until; }
+static inline uint8_t hal_eeprom_read(uint16_t addr) { return sim_eeprom[addr]; }
+
+static inline void hal_eeprom_write(uint16_t addr, uint8_t data) {
+    sim_eeprom[addr] = data;
+    sim_eeprom_busy_until = sim_us + SIM_EEPROM_WRITE_US;
+    sim_eeprom_writes++;
+}
+
+static inline void hal_button_irq(uint8_t button, uint8_t enable) {
+    // 꺼져 있는 동안의 에지는 플래그를 지우므로 그냥 버림 (AVR과 같음)
+    if (enable) {
+        sim_button_irq |= (1 << button);
+    } else {
+        sim_button_irq &= ~(1 << button);
+    }
+}
+
+#include "ATmega128_fan.c"
+
+/* -------------------------------------------------------------------------- */
+/* 시뮬레이션 설정 */
+/* -------------------------------------------------------------------------- */
+
+#define SIM_TIME_LIMIT_US     60000000UL  // 이 시간 안에 시나리오가 끝나지 않으면 실패
+#define SIM_BUTTON_PRESS_US   10000UL     // PD1 누름 시각 (채터링 포함)
+#define SIM_BUTTON_HOLD_US    150000UL    // PD1 누르고 있는 시간
+#define SIM_BUTTON_BOUNCE_US  300         // 채터링 에지 간격
+#define SIM_FAN_STEP_US       100         // 팬 모델 갱신 주기
+#define SIM_FAN_TAU_S         0.4         // 팬 회전수 1차 지연 시정수
+#define SIM_FAN_RPM_GAIN      4300.0      // 회전수 = (세기 - 오프셋) x 이득 (PI가 보정하도록 펌웨어 가정과 약간 다름)
+#define SIM_FAN_RPM_OFFSET    0.22
+#define SIM_FAN_REACH_PCT     5           // 팬 목표 회전수 도달 판정 (±%)
+#define SIM_SPI_BYTE_GAP_US   16          // 기본 바이트 간격 (Raspberry_fan.py SPI_BYTE_DELAY_US와 같게)
+
+// ISR 최악 사이클 (push ~ reti, 인터럽트 응답 제외). isr_cycles.py가 -D로 넘기지 않으면
+// -Os 코드를 손으로 센 추정값 (ISR을 고치면 isr_cycles.py로 다시 세서 확인)
+#ifndef SIM_CYCLES_MEASURED
+#define SIM_CYCLES_MEASURED   0
+#endif
+#ifndef SIM_CYCLES_SPI
+#define SIM_CYCLES_SPI        110   // SPI_STC 전체 (버퍼 교체 + 링버퍼 저장 포함)
+#endif
+#ifndef SIM_CYCLES_SPI_RELOAD
+#define SIM_CYCLES_SPI_RELOAD 60    // SPI_STC 진입 ~ 다음 응답 바이트 SPDR 쓰기
+#endif
+#ifndef SIM_CYCLES_TICK
+#define SIM_CYCLES_TICK       40    // TIMER0_COMP (sched_ticks++)
+#endif
+#ifndef SIM_CYCLES_TACH
+#define SIM_CYCLES_TACH       90    // INT7 (tach_isr_pulse)
+#endif
+#ifndef SIM_CYCLES_BUTTON
+#define SIM_CYCLES_BUTTON     160   // INT0/INT1 (button_begin 호출, 호출 레지스터 저장 포함)
+#endif
+#define SIM_CYCLES_IRQ_ENTRY  7     // 인터럽트 응답 4 + 벡터 jmp 3
+#define SIM_CYCLES_PER_US     (F_CPU / 1000000UL)
+
+// 각도 명령 순서 (0.1도, 처음 위치는 90도)
+static const uint16_t sim_targets[] = { 600, 1200, 300, 1500, 900, 950, 1000, 1700, 100, 1500 };
+#define SIM_TARGET_COUNT  (sizeof(sim_targets) / sizeof(sim_targets[0]))
+
+typedef struct {
+    const char *name;
+    uint32_t calls;
+    uint64_t total_ns;
+    uint64_t worst_ns;
+} sim_timing_t;
+
+static uint64_t sim_timer_overhead_ns = 0;
+
+static uint64_t host_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sim_timing_add(sim_timing_t *timing, uint64_t elapsed) {
+    elapsed = (elapsed > sim_timer_overhead_ns) ? elapsed - sim_timer_overhead_ns : 0;
+    timing->calls++;
+    timing->total_ns += elapsed;
+    if (elapsed > timing->worst_ns) timing->worst_ns = elapsed;
+}
+
+#define SIM_TIMED(timing, call) do {                  \
+        uint64_t sim_start = host_ns();               \
+        call;                                         \
+        sim_timing_add(&(timing), host_ns() - sim_start); \
+    } while (0)
+
+static sim_timing_t main_frames = { .name = "spi_poll_frames" };
+
+// ISR은 하나씩만 실행 (AVR은 ISR 안에서 인터럽트가 꺼짐). 나중에 온 ISR은 앞 ISR이 끝날 때까지 기다림
+// 우선순위(대기 중 여럿이면 벡터 번호 순)와 메인 루프의 ATOMIC_BLOCK 구간은 넣지 않음
+static uint64_t sim_cpu_busy_until = 0;     // 실행 중인 ISR이 끝나는 CPU 사이클
+static uint32_t sim_isr_worst_wait = 0;     // ISR이 앞 ISR 때문에 기다린 최대 사이클
+
+static uint64_t sim_isr_start(uint64_t at, uint32_t cycles) {
+    // at에 요청된 ISR의 본문 시작 사이클 (이 ISR이 끝나는 시각까지 CPU를 점유)
+    uint64_t start = (at > sim_cpu_busy_until ? at : sim_cpu_busy_until) + SIM_CYCLES_IRQ_ENTRY;
+    if (start - SIM_CYCLES_IRQ_ENTRY - at > sim_isr_worst_wait) {
+        sim_isr_worst_wait = (uint32_t)(start - SIM_CYCLES_IRQ_ENTRY - at);
+    }
+    sim_cpu_busy_until = start + cycles;
+    return start;
+}
+
+static uint64_t sim_cycles_now(void) {
+    return (uint64_t)sim_us * SIM_CYCLES_PER_US;
+}
+
+// 스케줄러 작업 실행 시간: 작업 표의 함수 포인터를 측정용 래퍼로 바꿈
+#define SIM_TASK_MAX  8
+static void (*sim_task_run[SIM_TASK_MAX])(void);
+static sim_timing_t sim_task_timing[SIM_TASK_MAX];
+
+#define SIM_TASK_WRAPPER(n) \
+    static void sim_task_##n(void) { SIM_TIMED(sim_task_timing[n], sim_task_run[n]()); }
+SIM_TASK_WRAPPER(0)
+SIM_TASK_WRAPPER(1)
+SIM_TASK_WRAPPER(2)
+SIM_TASK_WRAPPER(3)
+SIM_TASK_WRAPPER(4)
+SIM_TASK_WRAPPER(5)
+SIM_TASK_WRAPPER(6)
+SIM_TASK_WRAPPER(7)
+static void (*const sim_task_wrappers[SIM_TASK_MAX])(void) = {
+    sim_task_0, sim_task_1, sim_task_2, sim_task_3, sim_task_4, sim_task_5, sim_task_6, sim_task_7,
+};
+_Static_assert(SCHED_TASK_COUNT <= SIM_TASK_MAX, "작업이 늘었으면 SIM_TASK_MAX와 SIM_TASK_WRAPPER 추가");
+
+static const char *sim_task_name(void (*run)(void)) {
+    if (run == task_servo) return "task_servo";
+    if (run == task_buttons) return "task_buttons";
+    if (run == task_status) return "task_status";
+    if (run == task_fan_ramp) return "task_fan_ramp";
+    if (run == task_fan_rpm) return "task_fan_rpm";
+    if (run == task_eeprom) return "task_eeprom";
+    return "task_?";
+}
+
+/* -------------------------------------------------------------------------- */
+/* 가상 RPi (SPI 마스터) */
+/* -------------------------------------------------------------------------- */
+
+enum { PI_CONFIG, PI_WAIT_READY, PI_STARTING, PI_TRACKING, PI_HOMING, PI_DONE };
+
+typedef struct {
+    uint16_t from10;
+    uint16_t to10;
+    uint32_t sent_us;     // 새 목표가 실린 프레임 전송 완료 시각
+    uint32_t reached_us;  // 서보 OCR이 목표에 도달한 시각 (0 = 미도달)
+} sim_step_t;
+
+static struct {
+    uint8_t state;
+    uint8_t seq;
+    uint8_t tx[SPI_FRAME_LEN];
+    uint8_t rx[SPI_FRAME_LEN];
+    uint8_t byte_index;              // 전송 중인 바이트 (SPI_FRAME_LEN = 유휴)
+    uint64_t next_byte_cycle;        // 다음 바이트 전송이 끝나는 CPU 사이클
+    uint32_t next_frame_us;
+    uint32_t period_us;
+    uint32_t spi_hz;
+    uint32_t byte_cycles;            // 8비트 전송 시간 (CPU 사이클)
+    uint32_t gap_cycles;             // 바이트 사이 간격 (CPU 사이클)
+    uint8_t spdr_late;               // 직전 ISR이 다음 바이트 시작 전에 SPDR을 못 채움
+    uint32_t late_reloads;           // SPDR 재장전이 늦은 바이트 수 (RPi가 묵은 바이트를 받음)
+    uint32_t overruns;               // ISR이 읽기 전에 다음 바이트가 덮어쓴 수신 바이트 수
+    int32_t min_slack;               // SPDR 재장전 최소 여유 (사이클, 음수 = 늦음)
+    uint8_t slew;
+    uint8_t accel;
+    uint8_t config_step;             // PI_CONFIG에서 보낸 명령 수
+    uint8_t config_rejected;         // 설정 명령 중 ACK_OK가 아니었던 수
+    uint8_t last_status;
+    uint32_t frames;
+    uint32_t bad_frames;
+    uint8_t target_index;
+    uint8_t target_sent;             // 현재 목표를 한 번이라도 보냈는지
+    uint32_t dwell_us;
+    uint32_t ready_us;               // PD1 누름 -> READY 응답
+    uint32_t running_us;             // START 전송 -> RUNNING 응답
+    uint32_t start_sent_us;
+    uint32_t reset_sent_us;
+    uint32_t homed_us;
+    uint32_t fan_command_us;         // 팬 100% 명령 시각
+    uint32_t fan_reached_us;
+} pi;
+
+static sim_step_t sim_steps[SIM_TARGET_COUNT];
+
+static void pi_build_frame(uint8_t opcode, uint16_t value, uint8_t speed, uint8_t slew, uint16_t stamp) {
+    uint8_t i;
+
+    pi.seq++;
+    pi.tx[0] = SPI_CMD_HEADER;
+    pi.tx[1] = opcode;
+    pi.tx[2] = value & 0xFF;
+    pi.tx[3] = value >> 8;
+    pi.tx[4] = speed;
+    pi.tx[5] = slew;
+    pi.tx[6] = stamp & 0xFF;
+    pi.tx[7] = stamp >> 8;
+    for (i = 8; i < SPI_FRAME_LEN - 2; i++) pi.tx[i] = 0;
+    pi.tx[SPI_FRAME_LEN - 2] = pi.seq;
+    pi.tx[SPI_FRAME_LEN - 1] = crc8(&pi.tx[1], SPI_FRAME_LEN - 2);
+}
+
+static void pi_next_frame(void) {
+    // Raspberry_fan.py 제어 스레드처럼 주기마다 명령 1개
+    switch (pi.state) {
+        case PI_CONFIG:
+            // 최대 속도/가속 설정 -> EEPROM 저장 -> 저장 명령의 ack 확인용 조회
+            if (pi.config_step == 0) {
+                pi_build_frame(OP_SET_PARAM, pi.slew, PARAM_SLEW_MAX_STEP, SLEW_KEEP, 0);
+            } else if (pi.config_step == 1) {
+                pi_build_frame(OP_SET_PARAM, pi.accel, PARAM_SLEW_ACCEL, SLEW_KEEP, 0);
+            } else if (pi.config_step == 2) {
+                pi_build_frame(OP_SAVE_PARAMS, 0, 0, SLEW_KEEP, 0);
+            } else {
+                pi_build_frame(OP_POLL, 0, SPEED_KEEP, SLEW_KEEP, 0);
+                pi.state = PI_WAIT_READY;
+            }
+            pi.config_step++;
+            break;
+
+        case PI_WAIT_READY:
+            if (pi.last_status == STATUS_READY) {
+                pi_build_frame(OP_START, 0, SPEED_KEEP, SLEW_KEEP, 0);
+                pi.start_sent_us = sim_us;
+                pi.state = PI_STARTING;
+            } else {
+                pi_build_frame(OP_POLL, 0, SPEED_KEEP, SLEW_KEEP, 0);
+            }
+            break;
+
+        case PI_STARTING:
+            pi_build_frame(OP_POLL, 0, SPEED_KEEP, SLEW_KEEP, 0);
+            break;
+
+        case PI_TRACKING: {
+            uint16_t target = sim_targets[pi.target_index];
+            uint8_t speed = SPEED_KEEP;
+            if (pi.target_index == 0 && !pi.target_sent) {
+                speed = SPEED_POWER_FLAG | FAN_POWER_MAX;  // 첫 명령에 팬 최대 세기
+                pi.fan_command_us = sim_us;
+            }
+            pi_build_frame(OP_TRACK, target, speed, pi.slew, pi.target_index);
+            break;
+        }
+
+        case PI_HOMING:
+            if (!pi.reset_sent_us) {
+                pi_build_frame(OP_RESET, 0, SPEED_KEEP, SLEW_KEEP, 0);
+            } else {
+                pi_build_frame(OP_POLL, 0, SPEED_KEEP, SLEW_KEEP, 0);
+            }
+            break;
+
+        default:
+            pi_build_frame(OP_POLL, 0, SPEED_KEEP, SLEW_KEEP, 0);
+            break;
+    }
+    pi.byte_index = 0;
+    pi.next_byte_cycle = sim_cycles_now() + pi.byte_cycles;
+    pi.spdr_late = 0;
+    sim_spi_ss = 1;
+}
+
+static void pi_frame_done(void) {
+    // 같은 버스트에서 받은 상태 프레임 확인 (ack는 직전 명령)
+    pi.frames++;
+    if (pi.rx[0] != SPI_STATUS_HEADER || crc8(&pi.rx[1], SPI_FRAME_LEN - 2) != pi.rx[SPI_FRAME_LEN - 1]) {
+        pi.bad_frames++;
+        return;
+    }
+    pi.last_status = pi.rx[1];
+
+    if (pi.config_step >= 2 && pi.config_step <= 4) {
+        // 설정/저장 명령의 응답은 다음 프레임에 옴
+        if (pi.rx[3] != ACK_OK) pi.config_rejected++;
+        if (pi.config_step == 4) pi.config_step++;
+    }
+
+    if (pi.tx[1] == OP_TRACK && !pi.target_sent) {
+        // 이번 프레임에 새 목표가 실림: 여기서부터 도달 시간 측정
+        sim_step_t *step = &sim_steps[pi.target_index];
+        step->from10 = pi.target_index ? sim_targets[pi.target_index - 1] : 900;
+        step->to10 = sim_targets[pi.target_index];
+        step->sent_us = sim_us;
+        pi.target_sent = 1;
+    }
+    if (pi.tx[1] == OP_RESET) {
+        pi.reset_sent_us = sim_us;
+    }
+
+    if (pi.state == PI_WAIT_READY && pi.last_status == STATUS_READY && !pi.ready_us) {
+        pi.ready_us = sim_us;
+    } else if (pi.state == PI_STARTING && pi.last_status == STATUS_RUNNING) {
+        pi.running_us = sim_us;
+        pi.state = PI_TRACKING;
+    }
+}
+
+static void pi_step(void) {
+    if (pi.byte_index >= SPI_FRAME_LEN) {
+        if (pi.state == PI_DONE || sim_us < pi.next_frame_us) return;
+        pi.next_frame_us += pi.period_us;
+        pi_next_frame();
+    }
+    if (sim_cycles_now() < pi.next_byte_cycle) return;
+
+    // 한 바이트 교환 (done = 이 바이트 전송이 끝난 사이클)
+    // 마스터는 바이트 시작 때 SPDR에 있던 값을 받음. 그때까지 ISR이 못 채웠으면 시프트 레지스터에 남은
+    // 직전 수신 바이트가 나감 (늦은 쓰기는 WCOL로 무시)
+    uint64_t done = pi.next_byte_cycle;
+    uint8_t last = pi.byte_index == SPI_FRAME_LEN - 1;
+    pi.rx[pi.byte_index] = pi.spdr_late ? pi.tx[pi.byte_index - 1] : sim_spdr;
+    pi.spdr_late = 0;
+
+    uint64_t start = sim_isr_start(done, SIM_CYCLES_SPI);
+    if (!last && start > done + pi.gap_cycles + pi.byte_cycles) {
+        // SPDR을 읽기 전에 다음 바이트가 다 들어옴: 이 바이트는 사라지고 ISR은 다음 바이트로 한 번만 실행
+        pi.overruns++;
+        sim_cpu_busy_until = start - SIM_CYCLES_IRQ_ENTRY;
+    } else {
+        spi_isr_byte(pi.tx[pi.byte_index]);
+        if (!last) {
+            int32_t slack = (int32_t)((int64_t)(done + pi.gap_cycles) - (int64_t)(start + SIM_CYCLES_SPI_RELOAD));
+            if (slack < pi.min_slack) pi.min_slack = slack;
+            if (slack < 0) {
+                pi.spdr_late = 1;
+                pi.late_reloads++;
+            }
+        }
+    }
+    pi.byte_index++;
+    pi.next_byte_cycle = done + pi.gap_cycles + pi.byte_cycles;
+    if (pi.byte_index == SPI_FRAME_LEN) {
+        sim_spi_ss = 0;
+        pi_frame_done();
+    }
+}
+
+static void pi_check_progress(void) {
+    uint16_t position = servo_get_position();
+
+    if (pi.state == PI_TRACKING && pi.target_sent) {
+        sim_step_t *step = &sim_steps[pi.target_index];
+        if (!step->reached_us && position == angle10_to_ocr(step->to10)) {
+            step->reached_us = sim_us;
+        }
+        if (step->reached_us && sim_us - step->reached_us >= pi.dwell_us) {
+            pi.target_sent = 0;
+            if (++pi.target_index >= SIM_TARGET_COUNT) {
+                pi.state = PI_HOMING;
+            }
+        }
+    } else if (pi.state == PI_HOMING && pi.reset_sent_us && position == SERVO_CENTER && !motor_running) {
+        pi.homed_us = sim_us;
+        pi.state = PI_DONE;
+    }
+
+    if (pi.fan_command_us && !pi.fan_reached_us &&
+        fan_rpm * 100 >= (uint32_t)FAN_RPM_AT_MAX * (100 - SIM_FAN_REACH_PCT) &&
+        fan_rpm * 100 <= (uint32_t)FAN_RPM_AT_MAX * (100 + SIM_FAN_REACH_PCT)) {
+        pi.fan_reached_us = sim_us;
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+/* 버튼 / 팬 모델 */
+/* -------------------------------------------------------------------------- */
+
+static void sim_set_button(uint8_t button, uint8_t level) {
+    uint8_t mask = 1 << button;
+    uint8_t rising = level && !(sim_button_level & mask);
+
+    sim_button_level = level ? (sim_button_level | mask) : (sim_button_level & ~mask);
+    if (rising && (sim_button_irq & mask)) {
+        sim_isr_start(sim_cycles_now(), SIM_CYCLES_BUTTON);
+        button_begin(button);
+    }
+}
+
+static void sim_buttons_step(void) {
+    // PD1: 채터링 2번 후 눌림 유지, 뗄 때도 채터링
+    uint32_t t = sim_us;
+    if (t == SIM_BUTTON_PRESS_US) sim_set_button(BUTTON_TOGGLE, 1);
+    if (t == SIM_BUTTON_PRESS_US + SIM_BUTTON_BOUNCE_US) sim_set_button(BUTTON_TOGGLE, 0);
+    if (t == SIM_BUTTON_PRESS_US + 2 * SIM_BUTTON_BOUNCE_US) sim_set_button(BUTTON_TOGGLE, 1);
+    if (t == SIM_BUTTON_PRESS_US + 3 * SIM_BUTTON_BOUNCE_US) sim_set_button(BUTTON_TOGGLE, 0);
+    if (t == SIM_BUTTON_PRESS_US + 4 * SIM_BUTTON_BOUNCE_US) sim_set_button(BUTTON_TOGGLE, 1);
+    if (t == SIM_BUTTON_PRESS_US + SIM_BUTTON_HOLD_US) sim_set_button(BUTTON_TOGGLE, 0);
+    if (t == SIM_BUTTON_PRESS_US + SIM_BUTTON_HOLD_US + SIM_BUTTON_BOUNCE_US) sim_set_button(BUTTON_TOGGLE, 1);
+    if (t == SIM_BUTTON_PRESS_US + SIM_BUTTON_HOLD_US + 2 * SIM_BUTTON_BOUNCE_US) sim_set_button(BUTTON_TOGGLE, 0);
+}
+
+static double sim_rpm = 0;
+static uint32_t sim_next_tach_us = 0;
+
+static void sim_fan_step(void) {
+    // 듀티 반전: OCR이 작을수록 셈
+    double target = 0;
+    if (sim_fan_on) {
+        double strength = 1.0 - (double)sim_fan_ocr / (ICR_8KHZ + 1);
+        target = (strength - SIM_FAN_RPM_OFFSET) * SIM_FAN_RPM_GAIN;
+        if (target < 0) target = 0;
+    }
+    sim_rpm += (target - sim_rpm) * (SIM_FAN_STEP_US * 1e-6) / SIM_FAN_TAU_S;
+}
+
+static void sim_tach_step(void) {
+    uint32_t period;
+
+    if (sim_rpm < 60) {
+        sim_next_tach_us = 0;  // 거의 정지: 펄스 없음
+        return;
+    }
+    period = (uint32_t)(60e6 / (sim_rpm * FAN_TACH_PULSES_PER_REV));
+    if (!sim_next_tach_us) {
+        sim_next_tach_us = sim_us + period;
+    } else if (sim_us >= sim_next_tach_us) {
+        sim_isr_start(sim_cycles_now(), SIM_CYCLES_TACH);
+        tach_isr_pulse();
+        sim_next_tach_us += period;
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+/* 보고 */
+/* -------------------------------------------------------------------------- */
+
+static uint32_t sim_reload_budget(void) {
+    // 정적 예산: 가장 긴 다른 ISR이 막 시작한 순간 바이트가 끝나도 간격 안에 SPDR을 채워야 함
+    uint32_t other = SIM_CYCLES_TICK;
+    if (SIM_CYCLES_TACH > other) other = SIM_CYCLES_TACH;
+    if (SIM_CYCLES_BUTTON > other) other = SIM_CYCLES_BUTTON;
+    return SIM_CYCLES_IRQ_ENTRY + other + SIM_CYCLES_IRQ_ENTRY + SIM_CYCLES_SPI_RELOAD;
+}
+
+static void print_timing(const sim_timing_t *timing, const char *name) {
+    if (!timing->calls) {
+        printf("  %-18s %10s\n", name, "-");
+        return;
+    }
+    printf("  %-18s %10u %10.0f %10llu\n", name, timing->calls,
+           (double)timing->total_ns / timing->calls, (unsigned long long)timing->worst_ns);
+}
+
+static uint32_t print_report(void) {
+    uint32_t worst_ms = 0;
+    uint8_t i;
+
+    printf("\n=== 서보 추적 (슬루 %u, 가속 %u, 명령 주기 %lums, SPI %luHz + 바이트 간격 %luus) ===\n",
+           pi.slew, servo_slew_accel / SERVO_OCR_SCALE, (unsigned long)(pi.period_us / 1000),
+           (unsigned long)pi.spi_hz, (unsigned long)(pi.gap_cycles / SIM_CYCLES_PER_US));
+    printf("  %-16s %8s %10s\n", "명령", "거리(도)", "도달(ms)");
+    for (i = 0; i < SIM_TARGET_COUNT; i++) {
+        const sim_step_t *step = &sim_steps[i];
+        int distance = (int)step->to10 - (int)step->from10;
+        if (!step->sent_us) break;
+        if (step->reached_us) {
+            uint32_t ms = (step->reached_us - step->sent_us + 500) / 1000;
+            if (ms > worst_ms) worst_ms = ms;
+            printf("  %5.1f -> %5.1f    %8.1f %10lu\n", step->from10 / 10.0, step->to10 / 10.0,
+                   abs(distance) / 10.0, (unsigned long)ms);
+        } else {
+            printf("  %5.1f -> %5.1f    %8.1f %10s\n", step->from10 / 10.0, step->to10 / 10.0,
+                   abs(distance) / 10.0, "미도달");
+            worst_ms = UINT32_MAX;
+        }
+    }
+    printf("  최대 도달 시간: ");
+    if (worst_ms == UINT32_MAX) printf("미도달\n"); else printf("%lums\n", (unsigned long)worst_ms);
+
+    printf("\n=== 상태 전이 ===\n");
+    printf("  PD1 누름 -> READY 응답 : %s%lums\n", pi.ready_us ? "" : "미도달 ",
+           (unsigned long)(pi.ready_us ? (pi.ready_us - SIM_BUTTON_PRESS_US) / 1000 : 0));
+    printf("  START -> RUNNING 응답  : %lums\n",
+           (unsigned long)(pi.running_us ? (pi.running_us - pi.start_sent_us) / 1000 : 0));
+    if (pi.fan_reached_us) {
+        printf("  팬 100%% -> %u RPM ±%d%% : %lums\n", FAN_RPM_AT_MAX, SIM_FAN_REACH_PCT,
+               (unsigned long)((pi.fan_reached_us - pi.fan_command_us) / 1000));
+    } else {
+        printf("  팬 100%% -> %u RPM ±%d%% : 미도달 (측정 %u RPM)\n", FAN_RPM_AT_MAX, SIM_FAN_REACH_PCT, fan_rpm);
+    }
+    printf("  RESET -> 90도 복귀     : %s%lums\n", pi.homed_us ? "" : "미도달 ",
+           (unsigned long)(pi.homed_us ? (pi.homed_us - pi.reset_sent_us) / 1000 : 0));
+
+    printf("\n=== ISR 사이클 (%s, 인터럽트 응답 %u 별도) ===\n",
+           SIM_CYCLES_MEASURED ? "isr_cycles.py" : "추정값", SIM_CYCLES_IRQ_ENTRY);
+    printf("  %-18s %10u (SPDR까지 %u)\n", "SPI_STC", SIM_CYCLES_SPI, SIM_CYCLES_SPI_RELOAD);
+    printf("  %-18s %10u\n", "TIMER0_COMP", SIM_CYCLES_TICK);
+    printf("  %-18s %10u\n", "INT7 (FG)", SIM_CYCLES_TACH);
+    printf("  %-18s %10u\n", "INT0/INT1", SIM_CYCLES_BUTTON);
+    printf("  SPDR 재장전 최악 %u 사이클 / 바이트 간격 %lu 사이클 (%s)\n", sim_reload_budget(),
+           (unsigned long)pi.gap_cycles, sim_reload_budget() <= pi.gap_cycles ? "여유 있음" : "부족");
+    printf("  실행 중: 재장전 최소 여유 %ld 사이클, 늦은 재장전 %lu회, 수신 오버런 %lu회, ISR 대기 최대 %u 사이클\n",
+           (long)pi.min_slack, (unsigned long)pi.late_reloads, (unsigned long)pi.overruns, sim_isr_worst_wait);
+
+    printf("\n=== 실행 시간 (호스트 ns, 측정 오버헤드 %lluns 뺌, AVR 사이클 아님) ===\n",
+           (unsigned long long)sim_timer_overhead_ns);
+    printf("  %-18s %10s %10s %10s\n", "", "횟수", "평균", "최악");
+    print_timing(&main_frames, main_frames.name);
+    for (i = 0; i < SCHED_TASK_COUNT; i++) {
+        print_timing(&sim_task_timing[i], sim_task_name(sim_task_run[i]));
+    }
+
+    printf("\n=== 스케줄러 / SPI ===\n");
+    printf("  작업 재정렬(overrun) %u회, 프레임 %lu개 (상태 프레임 오류 %lu개)\n",
+           sched_overruns, (unsigned long)pi.frames, (unsigned long)pi.bad_frames);
+
+    // 저장된 블록으로 다시 시작한 것처럼 읽어서 확인
+    params_load();
+    printf("  설정: 거부 %u건, EEPROM 바이트 쓰기 %lu회, 다시 읽은 최대 속도 %u / 가속 %u %s\n",
+           pi.config_rejected, (unsigned long)sim_eeprom_writes, params[PARAM_SLEW_MAX_STEP],
+           params[PARAM_SLEW_ACCEL],
+           params[PARAM_SLEW_MAX_STEP] == pi.slew && params[PARAM_SLEW_ACCEL] == pi.accel ? "(일치)" : "(불일치)");
+    return worst_ms;
+}
+
+/* -------------------------------------------------------------------------- */
+/* 메인 */
+/* -------------------------------------------------------------------------- */
+
+int main(int argc, char **argv) {
+    uint32_t slew = SERVO_SLEW_MAX_STEP / SERVO_OCR_SCALE;
+    uint32_t accel = SERVO_SLEW_ACCEL / SERVO_OCR_SCALE;
+    uint32_t period_ms = 20;
+    uint32_t spi_hz = 1000000;
+    uint32_t gap_us = SIM_SPI_BYTE_GAP_US;
+    uint32_t dwell_ms = 200;
+    uint32_t max_ms = 0;
+    uint32_t worst_ms;
+    uint8_t i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:a:p:c:g:d:m:")) != -1) {
+        switch (opt) {
+            case 's': slew = strtoul(optarg, NULL, 0); break;
+            case 'a': accel = strtoul(optarg, NULL, 0); break;
+            case 'p': period_ms = strtoul(optarg, NULL, 0); break;
+            case 'c': spi_hz = strtoul(optarg, NULL, 0); break;
+            case 'g': gap_us = strtoul(optarg, NULL, 0); break;
+            case 'd': dwell_ms = strtoul(optarg, NULL, 0); break;
+            case 'm': max_ms = strtoul(optarg, NULL, 0); break;
+            default:
+                fprintf(stderr, "사용법: %s [-s 슬루] [-a 가속] [-p 명령 주기 ms] [-c SPI Hz] [-g 바이트 간격 us] "
+                        "[-d 도달 후 대기 ms] [-m 최대 허용 도달 ms]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (slew < 1 || slew > 255 || accel < 1 || accel > 255 || period_ms < 1 || spi_hz < 8000) {
+        fprintf(stderr, "오류: 슬루/가속 1~255, 주기 1 이상, SPI 8000Hz 이상\n");
+        return 2;
+    }
+
+    // 측정 오버헤드 (빈 구간의 최소값)
+    sim_timer_overhead_ns = UINT64_MAX;
+    for (i = 0; i < 200; i++) {
+        uint64_t start = host_ns();
+        uint64_t elapsed = host_ns() - start;
+        if (elapsed < sim_timer_overhead_ns) sim_timer_overhead_ns = elapsed;
+    }
+
+    // 펌웨어 main()과 같은 순서 (하드웨어 초기화 대신 인터럽트 허용만)
+    sim_button_irq = (1 << BUTTON_SPEED) | (1 << BUTTON_TOGGLE);
+    memset(sim_eeprom, 0xFF, sizeof(sim_eeprom));
+    init_state();
+    hal_spi_write(SPI_STATUS_HEADER);
+
+    for (i = 0; i < SCHED_TASK_COUNT; i++) {
+        sim_task_run[i] = sched_tasks[i].run;
+        sim_task_timing[i].name = sim_task_name(sched_tasks[i].run);
+        sched_tasks[i].run = sim_task_wrappers[i];
+    }
+
+    pi.state = PI_CONFIG;
+    pi.byte_index = SPI_FRAME_LEN;
+    pi.period_us = period_ms * 1000;
+    pi.spi_hz = spi_hz;
+    pi.byte_cycles = (uint32_t)(8ULL * F_CPU / spi_hz);
+    pi.gap_cycles = gap_us * SIM_CYCLES_PER_US;
+    pi.min_slack = INT32_MAX;
+    pi.slew = slew;
+    pi.accel = accel;
+    pi.last_status = 0xFF;
+    pi.dwell_us = dwell_ms * 1000;
+
+    while (pi.state != PI_DONE && sim_us < SIM_TIME_LIMIT_US) {
+        sim_us++;
+        if (sim_us % 1000 == 0) {
+            sim_isr_start(sim_cycles_now(), SIM_CYCLES_TICK);
+            sched_tick_isr();
+        }
+        if (sim_us % SIM_FAN_STEP_US == 0) sim_fan_step();
+        sim_tach_step();
+        sim_buttons_step();
+        pi_step();
+
+        // 펌웨어 메인 루프
+        if (spi_rx_tail != spi_rx_head) {
+            SIM_TIMED(main_frames, spi_poll_frames());
+        } else {
+            spi_poll_frames();  // 프레임 사이 SS 재동기만
+        }
+        scheduler_run();
+
+        pi_check_progress();
+    }
+
+    printf("시뮬레이션 %.2f초 (%s)\n", sim_us / 1e6, pi.state == PI_DONE ? "시나리오 완료" : "시간 초과");
+    worst_ms = print_report();
+
+    if (pi.state != PI_DONE) return 1;
+    if (pi.bad_frames || pi.overruns) {
+        printf("\n실패: SPI 상태 프레임 오류 %lu개, 수신 오버런 %lu회 (-c/-g와 ISR 사이클 확인)\n",
+               (unsigned long)pi.bad_frames, (unsigned long)pi.overruns);
+        return 1;
+    }
+    if (sim_reload_budget() > pi.gap_cycles) {
+        printf("\n실패: 바이트 간격 %lu 사이클 < SPDR 재장전 최악 %u 사이클 (시나리오에서 안 겹쳤을 뿐)\n",
+               (unsigned long)pi.gap_cycles, sim_reload_budget());
+        return 1;
+    }
+    if (pi.config_rejected || params[PARAM_SLEW_MAX_STEP] != pi.slew || params[PARAM_SLEW_ACCEL] != pi.accel) {
+        printf("\n실패: 설정 저장/복원이 맞지 않음\n");
+        return 1;
+    }
+    if (max_ms && worst_ms > max_ms) {
+        printf("\n실패: 최대 도달 시간 %lums > 허용 %lums\n", (unsigned long)worst_ms, (unsigned long)max_ms);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,121 @@
+"""
+ATmega128_fan.c ISR 최악 사이클 수 (avr-objdump 디스어셈블에서 계산, 개발 PC에서 실행)
+
+- ISR 함수(__vector_N)의 모든 명령 사이클을 더한 값 = 상한 (분기 없는 경로만 있다고 보고 각 명령 1번)
+  분기는 2, 건너뛰기(sbrs/cpse 등)는 1 + 건너뛸 명령, call은 호출한 함수 합계까지 더함
+- 뒤로 가는 분기(루프)가 있으면 경고 (루프 몸체는 1번만 세므로 상한이 아님)
+- 인터럽트 응답 + 벡터 jmp(7사이클)은 빼고, 상태 저장(push)~reti는 포함 (fan_sim.c가 응답 시간을 따로 더함)
+- SPI_STC는 SPDR(0x0f)에 쓰는 마지막 명령까지의 사이클도 계산 (다음 바이트 전에 다시 채워야 하는 시간)
+
+사용 예:
+    avr-gcc -mmcu=atmega128 -Os -o fan.elf ATmega128_fan.c
+    avr-objdump -d fan.elf > fan.lss
+    gcc -std=gnu11 -O2 -Wall $(python3 isr_cycles.py fan.lss) -o fan_sim fan_sim.c
+"""
+import argparse
+import re
+import sys
+
+# ATmega128 벡터 번호 (avr-libc iom128.h)
+ISR_VECTORS = {
+    'INT0': '__vector_1',
+    'INT1': '__vector_2',
+    'INT7': '__vector_8',
+    'TIMER0_COMP': '__vector_15',
+    'SPI_STC': '__vector_17',
+}
+SPDR_WRITE = re.compile(r'^(out\s+0x0f|sts\s+0x002[fF]),')
+
+# 명령 사이클 (ATmega128, 나열하지 않은 명령은 1)
+CYCLES = {
+    'adiw': 2, 'sbiw': 2, 'mul': 2, 'muls': 2, 'mulsu': 2, 'fmul': 2, 'fmuls': 2, 'fmulsu': 2,
+    'ld': 2, 'ldd': 2, 'st': 2, 'std': 2, 'lds': 2, 'sts': 2, 'push': 2, 'pop': 2,
+    'sbi': 2, 'cbi': 2, 'rjmp': 2, 'ijmp': 2, 'jmp': 3, 'rcall': 3, 'icall': 3,
+    'lpm': 3, 'elpm': 3, 'call': 4, 'ret': 4, 'reti': 4,
+}
+SKIPS = {'sbrc', 'sbrs', 'sbic', 'sbis', 'cpse'}
+
+FUNCTION_LINE = re.compile(r'^([0-9a-f]+) <([\w.]+)>:$')
+INSTRUCTION_LINE = re.compile(r'^\s*([0-9a-f]+):\s+(?:[0-9a-f]{2} )+\s*([a-z]+)\s*([^;]*)(?:;\s*0x([0-9a-f]+)(?: <([\w.]+)(\+0x[0-9a-f]+)?>)?)?')
+
+
+def parse_listing(path):
+    """함수 이름 -> [(주소, 명령, 피연산자, 대상 주소, 대상 함수)]"""
+    functions = {}
+    current = None
+    with open(path) as listing:
+        for line in listing:
+            line = line.rstrip('\n')
+            match = FUNCTION_LINE.match(line)
+            if match:
+                current = functions.setdefault(match.group(2), [])
+                continue
+            match = INSTRUCTION_LINE.match(line)
+            if match and current is not None:
+                address, mnemonic, operands, target, target_name, offset = match.groups()
+                current.append((int(address, 16), mnemonic, operands.strip(),
+                                int(target, 16) if target else None,
+                                target_name if target_name and not offset else None))
+    return functions
+
+
+def instruction_cycles(mnemonic):
+    if mnemonic in SKIPS:
+        return 1  # 건너뛴 명령의 사이클이 합계에 이미 들어 있음
+    if mnemonic.startswith('br'):
+        return 2
+    return CYCLES.get(mnemonic, 1)
+
+
+def function_cycles(functions, name, warnings, stack=()):
+    """(전체 상한, SPDR 마지막 쓰기까지 상한 또는 None)"""
+    if name not in functions:
+        raise SystemExit(f"오류: 디스어셈블에 {name}가 없습니다")
+    if name in stack:
+        raise SystemExit(f"오류: 재귀 호출 {' -> '.join(stack + (name,))}")
+    total = 0
+    until_spdr = None
+    for address, mnemonic, operands, target, target_name in functions[name]:
+        total += instruction_cycles(mnemonic)
+        if mnemonic in ('call', 'rcall') and target_name:
+            total += function_cycles(functions, target_name, warnings, stack + (name,))[0]
+        elif mnemonic in ('icall', 'ijmp'):
+            warnings.append(f"{name}: 간접 호출/점프 ({address:#x}), 대상 사이클 빠짐")
+        elif target is not None and target <= address and (mnemonic.startswith('br') or mnemonic == 'rjmp'):
+            warnings.append(f"{name}: 루프 ({address:#x} -> {target:#x}), 반복 횟수만큼 더해야 함")
+        if SPDR_WRITE.match(f"{mnemonic} {operands}"):
+            until_spdr = total
+    return total, until_spdr
+
+
+def main():
+    parser = argparse.ArgumentParser(description='ATmega128_fan.c ISR 최악 사이클 (fan_sim.c -D 플래그 출력)')
+    parser.add_argument('listing', help='avr-objdump -d 출력 (.lss)')
+    args = parser.parse_args()
+
+    functions = parse_listing(args.listing)
+    warnings = []
+    cycles = {}
+    for isr, vector in ISR_VECTORS.items():
+        cycles[isr] = function_cycles(functions, vector, warnings)
+
+    print(f"{'ISR':<14}{'최악':>8}{'SPDR까지':>10}", file=sys.stderr)
+    for isr, (total, until_spdr) in cycles.items():
+        print(f"{isr:<14}{total:>8}{until_spdr if until_spdr is not None else '-':>10}", file=sys.stderr)
+    for warning in warnings:
+        print(f"⚠ {warning}", file=sys.stderr)
+    if cycles['SPI_STC'][1] is None:
+        raise SystemExit("오류: SPI_STC ISR에서 SPDR 쓰기를 찾지 못했습니다")
+
+    flags = {
+        'SIM_CYCLES_SPI': cycles['SPI_STC'][0],
+        'SIM_CYCLES_SPI_RELOAD': cycles['SPI_STC'][1],
+        'SIM_CYCLES_TICK': cycles['TIMER0_COMP'][0],
+        'SIM_CYCLES_TACH': cycles['INT7'][0],
+        'SIM_CYCLES_BUTTON': max(cycles['INT0'][0], cycles['INT1'][0]),
+    }
+    print(' '.join(f"-D{name}={value}" for name, value in flags.items()) + ' -DSIM_CYCLES_MEASURED=1')
+
+
+if __name__ == '__main__':
+    main()